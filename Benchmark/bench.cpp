@@ -0,0 +1,650 @@
+// Benchmarks the allocator levels, with glibc malloc as the baseline, on a few standard workloads:
+//
+//     g++ -std=c++17 -O2 -pthread -o bench bench.cpp glibc.cpp level_1.cpp level_2.cpp level_3.cpp level_4.cpp
+//     ./bench [ops] [allocator...]
+//
+// ops is the number of allocator calls each workload makes (the large buffer churn makes 1/_LARGE_OPS_DIVISOR of them),
+// and the allocators to run can be picked by name (all of them by default).
+// Every (workload, allocator) pair runs in a child process of its own, so that the levels never share a heap and the
+// peak RSS is that of the pair alone. For each pair it reports:
+//   ops/s       - allocator calls per second over the whole workload loop (which also touches the memory it gets).
+//   p50..p999   - the latency of single calls, in ns.
+//   peak RSS    - the growth of the resident set over the run.
+//   frag        - the share of the resident set growth that did not hold live bytes, at the peak of the workload.
+// Then the levels that have one run their check of the calls that the workloads do not make, in a child process too.
+// The exit status is 1 if a pair crashed or lost the contents of a block, or if a check failed, so the run doubles as a
+// regression check.
+#include "bench.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <thread>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <fcntl.h>
+
+#define _DEFAULT_OPS 200000
+#define _SLOTS 16384 // The number of blocks the churn workloads keep live.
+#define _REALLOC_BUFFERS 64
+#define _REALLOC_MAX (1024 * 1024) // A growing buffer is freed and started over once it reaches this size.
+#define _LARGE_SLOTS 16
+#define _LARGE_MIN (128 * 1024)
+#define _LARGE_OPS_DIVISOR 50 // Touching every page of the large buffers dominates, so they make fewer calls.
+#define _QUEUE_SIZE 1024 // The capacity of the producer/consumer queue.
+#define _POWER_LAW_ALPHA 1.2
+#define _POWER_LAW_MAX (256 * 1024)
+#define _PAGE_SIZE 4096
+#define _ADDRESS_SPACE_LIMIT (4UL * 1024 * 1024 * 1024) // Per child, so that a level that never reuses memory fails its calls.
+
+static const _BenchAllocator* const _allocators[] = { &_bench_glibc, &_bench_malloc_1, &_bench_malloc_2, &_bench_malloc_3,
+    &_bench_malloc_4 };
+
+// What a child process sends back for a (workload, allocator) pair.
+struct _BenchResult
+{
+    bool skipped;
+    size_t calls;
+    size_t failed_calls; // The allocations that returned NULL.
+    size_t corrupted_blocks; // The blocks whose contents were lost by srealloc().
+    double seconds;
+    uint32_t p50, p99, p999;
+    size_t peak_rss;
+    double fragmentation;
+};
+
+// ********** Helpers ********** //
+// The memory of the benchmark itself is mapped directly, so that it neither goes through the allocator that is measured,
+// nor moves the program break under a level that uses sbrk().
+static void* _benchMap(size_t size)
+{
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(p == MAP_FAILED)
+    {
+        perror("mmap");
+        _exit(1);
+    }
+    return p;
+}
+
+static uint64_t _now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// The current resident set, read from /proc without allocating.
+static size_t _residentBytes()
+{
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    ssize_t n = fd < 0? -1 : read(fd, buf, sizeof(buf) - 1);
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+    if(n <= 0)
+    {
+        return 0;
+    }
+    buf[n] = '\0';
+    char* field = strchr(buf, ' ');
+    return field? strtoull(field + 1, nullptr, 10) * sysconf(_SC_PAGESIZE) : 0;
+}
+
+// xorshift64*, so that every allocator sees the same sequence of requests.
+static uint64_t _random(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double _uniform(uint64_t* state)
+{
+    return (_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Write to the first and last byte of a block, as a user of it would.
+static void _touch(void* p, size_t size)
+{
+    static_cast<volatile char*>(p)[0] = 1;
+    static_cast<volatile char*>(p)[size - 1] = 1;
+}
+
+// Write tag to the first and last byte of a block, to check later that they were kept.
+static void _tag(void* p, size_t size, char tag)
+{
+    static_cast<volatile char*>(p)[0] = tag;
+    static_cast<volatile char*>(p)[size - 1] = tag;
+}
+
+static bool _hasTag(void* p, size_t size, char tag)
+{
+    return static_cast<volatile char*>(p)[0] == tag && static_cast<volatile char*>(p)[size - 1] == tag;
+}
+// $$$$$$$$$$ Helpers $$$$$$$$$$ //
+
+// ********** Runs ********** //
+// The latencies of the calls made by one thread.
+struct _Recorder
+{
+    uint32_t* samples;
+    size_t count;
+};
+
+// The state of one workload run against one allocator. Every call is timed into the recorder of the calling thread.
+class _BenchRun
+{
+private:
+    const _BenchAllocator* alloc;
+    bool serialize; // Whether the calls must be serialized (a level that is not thread-safe, used by several threads).
+    std::mutex lock;
+    std::atomic<size_t> live_bytes;
+    std::atomic<size_t> failed_calls;
+
+    void record(_Recorder& rec, uint64_t start)
+    {
+        uint64_t ns = _now() - start;
+        rec.samples[rec.count++] = ns > UINT32_MAX? UINT32_MAX : uint32_t(ns);
+    }
+
+public:
+    size_t ops; // The number of calls the workload should make.
+    _Recorder rec[2];
+    size_t snapshot_live;
+    size_t snapshot_rss;
+    size_t corrupted_blocks; // Counted by the single-threaded workloads that check the contents of their blocks.
+
+    _BenchRun(const _BenchAllocator* alloc, size_t ops, bool threads) :
+    alloc(alloc), serialize(threads && !alloc->thread_safe), live_bytes(0), failed_calls(0), ops(ops), rec(),
+    snapshot_live(0), snapshot_rss(0), corrupted_blocks(0)
+    {
+    }
+
+    size_t getFailedCalls() const
+    {
+        return failed_calls.load(std::memory_order_relaxed);
+    }
+
+    void* smalloc(_Recorder& rec, size_t size)
+    {
+        uint64_t start = _now();
+        void* p;
+        if(serialize)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            p = alloc->smalloc(size);
+        }
+        else
+        {
+            p = alloc->smalloc(size);
+        }
+        record(rec, start);
+        if(p)
+        {
+            live_bytes.fetch_add(size, std::memory_order_relaxed);
+        }
+        else
+        {
+            failed_calls.fetch_add(1, std::memory_order_relaxed);
+        }
+        return p;
+    }
+
+    // Without a sfree() (malloc_1), the block is leaked, but the workload still counts it as gone.
+    void sfree(_Recorder& rec, void* p, size_t size)
+    {
+        uint64_t start = _now();
+        if(alloc->sfree && serialize)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            alloc->sfree(p);
+        }
+        else if(alloc->sfree)
+        {
+            alloc->sfree(p);
+        }
+        record(rec, start);
+        live_bytes.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    void* srealloc(_Recorder& rec, void* oldp, size_t old_size, size_t size)
+    {
+        uint64_t start = _now();
+        void* p = alloc->srealloc(oldp, size);
+        record(rec, start);
+        if(p)
+        {
+            live_bytes.fetch_add(size - old_size, std::memory_order_relaxed);
+        }
+        else
+        {
+            failed_calls.fetch_add(1, std::memory_order_relaxed);
+        }
+        return p;
+    }
+
+    // Take the numbers of the fragmentation at the peak of the workload.
+    void snapshot()
+    {
+        snapshot_live = live_bytes.load(std::memory_order_relaxed);
+        snapshot_rss = _residentBytes();
+    }
+};
+// $$$$$$$$$$ Runs $$$$$$$$$$ //
+
+// ********** Workloads ********** //
+// Same-size churn: free and reallocate random blocks of a pool of 64 byte blocks.
+static void _sameSizeChurn(_BenchRun& run)
+{
+    const size_t size = 64;
+    void** slots = static_cast<void**>(_benchMap(_SLOTS * sizeof(void*)));
+    uint64_t seed = 1;
+    _Recorder& rec = run.rec[0];
+    while(rec.count < run.ops)
+    {
+        size_t i = _random(&seed) % _SLOTS;
+        if(slots[i])
+        {
+            run.sfree(rec, slots[i], size);
+        }
+        slots[i] = run.smalloc(rec, size);
+        if(slots[i])
+        {
+            _touch(slots[i], size);
+        }
+    }
+    run.snapshot();
+    for(size_t i = 0; i < _SLOTS; i++)
+    {
+        if(slots[i])
+        {
+            run.sfree(rec, slots[i], size);
+        }
+    }
+}
+
+// Random sizes: like the same-size churn, but the sizes follow a power law (most blocks are small, a few are huge).
+static void _powerLaw(_BenchRun& run)
+{
+    void** slots = static_cast<void**>(_benchMap(_SLOTS * sizeof(void*)));
+    size_t* sizes = static_cast<size_t*>(_benchMap(_SLOTS * sizeof(size_t)));
+    uint64_t seed = 2;
+    _Recorder& rec = run.rec[0];
+    while(rec.count < run.ops)
+    {
+        size_t i = _random(&seed) % _SLOTS;
+        if(slots[i])
+        {
+            run.sfree(rec, slots[i], sizes[i]);
+        }
+        double size = 16 * pow(1 - _uniform(&seed), -1 / _POWER_LAW_ALPHA);
+        sizes[i] = size > _POWER_LAW_MAX? _POWER_LAW_MAX : size_t(size);
+        slots[i] = run.smalloc(rec, sizes[i]);
+        if(slots[i])
+        {
+            _touch(slots[i], sizes[i]);
+        }
+    }
+    run.snapshot();
+    for(size_t i = 0; i < _SLOTS; i++)
+    {
+        if(slots[i])
+        {
+            run.sfree(rec, slots[i], sizes[i]);
+        }
+    }
+}
+
+// Producer/consumer: one thread allocates messages of 16 to 512 bytes, and another one frees them.
+struct _Queue
+{
+    void* items[_QUEUE_SIZE];
+    size_t sizes[_QUEUE_SIZE];
+    std::atomic<size_t> head; // The next item to pop, only moved by the consumer.
+    std::atomic<size_t> tail; // The next item to push, only moved by the producer.
+};
+
+static void _producer(_BenchRun* run, _Queue* queue, size_t messages)
+{
+    uint64_t seed = 3;
+    _Recorder& rec = run->rec[0];
+    for(size_t i = 0; i < messages; i++)
+    {
+        size_t size = 16 + _random(&seed) % 497;
+        void* p = run->smalloc(rec, size);
+        if(p == nullptr)
+        {
+            size = 0;
+        }
+        else
+        {
+            _touch(p, size);
+        }
+        size_t tail = queue->tail.load(std::memory_order_relaxed);
+        while(tail - queue->head.load(std::memory_order_acquire) == _QUEUE_SIZE)
+        {
+            sched_yield();
+        }
+        queue->items[tail % _QUEUE_SIZE] = p;
+        queue->sizes[tail % _QUEUE_SIZE] = size;
+        queue->tail.store(tail + 1, std::memory_order_release);
+        if(i == messages / 2)
+        {
+            run->snapshot();
+        }
+    }
+}
+
+static void _consumer(_BenchRun* run, _Queue* queue, size_t messages)
+{
+    _Recorder& rec = run->rec[1];
+    for(size_t i = 0; i < messages; i++)
+    {
+        size_t head = queue->head.load(std::memory_order_relaxed);
+        while(queue->tail.load(std::memory_order_acquire) == head)
+        {
+            sched_yield();
+        }
+        void* p = queue->items[head % _QUEUE_SIZE];
+        if(p)
+        {
+            run->sfree(rec, p, queue->sizes[head % _QUEUE_SIZE]);
+        }
+        queue->head.store(head + 1, std::memory_order_release);
+    }
+}
+
+static void _producerConsumer(_BenchRun& run)
+{
+    _Queue* queue = new (_benchMap(sizeof(_Queue))) _Queue();
+    std::thread consumer(_consumer, &run, queue, run.ops / 2);
+    _producer(&run, queue, run.ops / 2);
+    consumer.join();
+}
+
+// Realloc growth: buffers grow by a quarter at a time, and start over once they reach _REALLOC_MAX.
+// It also checks that srealloc() keeps the contents: the ends of each buffer hold a tag of its own, which must be at
+// the same offsets in the grown buffer.
+static void _reallocGrowth(_BenchRun& run)
+{
+    void** buffers = static_cast<void**>(_benchMap(_REALLOC_BUFFERS * sizeof(void*)));
+    size_t* sizes = static_cast<size_t*>(_benchMap(_REALLOC_BUFFERS * sizeof(size_t)));
+    uint64_t seed = 4;
+    _Recorder& rec = run.rec[0];
+    while(rec.count < run.ops)
+    {
+        size_t i = _random(&seed) % _REALLOC_BUFFERS;
+        if(buffers[i] == nullptr || sizes[i] >= _REALLOC_MAX)
+        {
+            if(buffers[i])
+            {
+                run.sfree(rec, buffers[i], sizes[i]);
+            }
+            sizes[i] = 16;
+            buffers[i] = run.smalloc(rec, sizes[i]);
+        }
+        else
+        {
+            size_t size = sizes[i] + sizes[i] / 4 + 16;
+            void* p = run.srealloc(rec, buffers[i], sizes[i], size);
+            if(p)
+            {
+                if(!_hasTag(p, sizes[i], char(i + 1)))
+                {
+                    run.corrupted_blocks++;
+                }
+                buffers[i] = p;
+                sizes[i] = size;
+            }
+        }
+        if(buffers[i])
+        {
+            _tag(buffers[i], sizes[i], char(i + 1));
+        }
+    }
+    run.snapshot();
+    for(size_t i = 0; i < _REALLOC_BUFFERS; i++)
+    {
+        if(buffers[i])
+        {
+            run.sfree(rec, buffers[i], sizes[i]);
+        }
+    }
+}
+
+// Large buffer churn: replace random buffers of 128KB to 8MB, and write to every page of each new one.
+static void _largeChurn(_BenchRun& run)
+{
+    void* slots[_LARGE_SLOTS] = { };
+    size_t sizes[_LARGE_SLOTS] = { };
+    uint64_t seed = 5;
+    _Recorder& rec = run.rec[0];
+    while(rec.count < run.ops)
+    {
+        size_t i = _random(&seed) % _LARGE_SLOTS;
+        if(slots[i])
+        {
+            run.sfree(rec, slots[i], sizes[i]);
+        }
+        sizes[i] = size_t(_LARGE_MIN * pow(2, 6 * _uniform(&seed)));
+        slots[i] = run.smalloc(rec, sizes[i]);
+        if(slots[i])
+        {
+            for(size_t offset = 0; offset < sizes[i]; offset += _PAGE_SIZE)
+            {
+                static_cast<volatile char*>(slots[i])[offset] = 1;
+            }
+        }
+    }
+    run.snapshot();
+    for(size_t i = 0; i < _LARGE_SLOTS; i++)
+    {
+        if(slots[i])
+        {
+            run.sfree(rec, slots[i], sizes[i]);
+        }
+    }
+}
+
+struct _Workload
+{
+    const char* name;
+    void (*run)(_BenchRun& run);
+    size_t ops_divisor;
+    bool threads;
+    bool needs_free; // Leaking every block (without a sfree()) would exhaust the memory.
+    bool needs_realloc;
+};
+
+static const _Workload _workloads[] = {
+    { "same-size churn", _sameSizeChurn, 1, false, false, false },
+    { "power-law sizes", _powerLaw, 1, false, false, false },
+    { "producer/consumer", _producerConsumer, 1, true, false, false },
+    { "realloc growth", _reallocGrowth, 1, false, true, true },
+    { "large buffer churn", _largeChurn, _LARGE_OPS_DIVISOR, false, true, false },
+};
+// $$$$$$$$$$ Workloads $$$$$$$$$$ //
+
+// ********** Driver ********** //
+static uint32_t _percentile(uint32_t* samples, size_t count, double fraction)
+{
+    if(count == 0)
+    {
+        return 0;
+    }
+    size_t k = size_t(fraction * (count - 1));
+    std::nth_element(samples, samples + k, samples + count);
+    return samples[k];
+}
+
+// Run a workload against an allocator. Called in a child process of its own.
+static _BenchResult _runWorkload(const _Workload& workload, const _BenchAllocator* alloc, size_t ops)
+{
+    _BenchResult result = { };
+    if((workload.needs_free && alloc->sfree == nullptr) || (workload.needs_realloc && alloc->srealloc == nullptr))
+    {
+        result.skipped = true;
+        return result;
+    }
+    rlimit limit = { _ADDRESS_SPACE_LIMIT, _ADDRESS_SPACE_LIMIT };
+    setrlimit(RLIMIT_AS, &limit);
+    if(alloc->uses_sbrk)
+    {
+        mallopt(M_MMAP_THRESHOLD, 0); // Anything glibc still allocates (like the thread of the consumer) is mmapped.
+    }
+
+    ops /= workload.ops_divisor;
+    size_t capacity = ops + 2 * _SLOTS; // The final frees are recorded as well.
+    uint32_t* samples = static_cast<uint32_t*>(_benchMap(2 * capacity * sizeof(uint32_t)));
+    _BenchRun run(alloc, ops, workload.threads);
+    run.rec[0].samples = samples;
+    run.rec[1].samples = samples + capacity;
+
+    size_t rss_base = _residentBytes();
+    uint64_t start = _now();
+    workload.run(run);
+    result.seconds = (_now() - start) / 1e9;
+
+    // Both recorders are merged into the first one:
+    memmove(samples + run.rec[0].count, run.rec[1].samples, run.rec[1].count * sizeof(uint32_t));
+    result.calls = run.rec[0].count + run.rec[1].count;
+    result.failed_calls = run.getFailedCalls();
+    result.corrupted_blocks = run.corrupted_blocks;
+    result.p50 = _percentile(samples, result.calls, 0.5);
+    result.p99 = _percentile(samples, result.calls, 0.99);
+    result.p999 = _percentile(samples, result.calls, 0.999);
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t peak_rss = size_t(usage.ru_maxrss) * 1024;
+    result.peak_rss = peak_rss > rss_base? peak_rss - rss_base : 0;
+    size_t footprint = run.snapshot_rss > rss_base? run.snapshot_rss - rss_base : 0;
+    result.fragmentation = footprint > run.snapshot_live? double(footprint - run.snapshot_live) / footprint : 0;
+    return result;
+}
+
+// Whether the allocator was picked on the command line (all of them are by default).
+static bool _isSelected(const _BenchAllocator* alloc, int argc, char* argv[])
+{
+    bool selected = argc <= 2;
+    for(int i = 2; i < argc; i++)
+    {
+        selected = selected || strcmp(argv[i], alloc->name) == 0;
+    }
+    return selected;
+}
+
+// Run the check of an allocator in a child process, and return whether it passed.
+static bool _runCheck(const _BenchAllocator* alloc)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        _exit(alloc->check()? 0 : 1);
+    }
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t ops = argc > 1? strtoull(argv[1], nullptr, 10) : _DEFAULT_OPS;
+    if(ops == 0)
+    {
+        fprintf(stderr, "usage: %s [ops] [allocator...]\n", argv[0]);
+        return 1;
+    }
+
+    int status_code = 0;
+    printf("%-20s %-10s %12s %8s %8s %8s %9s %12s %7s\n", "workload", "allocator", "ops/s", "p50(ns)", "p99(ns)",
+        "p999(ns)", "vs glibc", "peak RSS(MB)", "frag");
+    for(const _Workload& workload : _workloads)
+    {
+        double baseline = 0;
+        for(const _BenchAllocator* alloc : _allocators)
+        {
+            if(!_isSelected(alloc, argc, argv))
+            {
+                continue;
+            }
+
+            fflush(stdout);
+            int fds[2];
+            if(pipe(fds) != 0)
+            {
+                perror("pipe");
+                return 1;
+            }
+            pid_t pid = fork();
+            if(pid == 0)
+            {
+                close(fds[0]);
+                _BenchResult result = _runWorkload(workload, alloc, ops);
+                ssize_t written = write(fds[1], &result, sizeof(result));
+                _exit(written == sizeof(result)? 0 : 1);
+            }
+            close(fds[1]);
+            _BenchResult result;
+            ssize_t got = read(fds[0], &result, sizeof(result));
+            close(fds[0]);
+            int status;
+            waitpid(pid, &status, 0);
+
+            printf("%-20s %-10s ", workload.name, alloc->name);
+            if(got != sizeof(result))
+            {
+                printf("failed (%s %d)\n", WIFSIGNALED(status)? "signal" : "exit status",
+                    WIFSIGNALED(status)? WTERMSIG(status) : WEXITSTATUS(status));
+                status_code = 1;
+                continue;
+            }
+            if(result.skipped)
+            {
+                printf("skipped (no %s)\n", workload.needs_realloc && alloc->srealloc == nullptr? "srealloc" : "sfree");
+                continue;
+            }
+            double rate = result.calls / result.seconds;
+            if(alloc == &_bench_glibc)
+            {
+                baseline = rate;
+            }
+            printf("%12.0f %8u %8u %8u ", rate, result.p50, result.p99, result.p999);
+            if(baseline > 0)
+            {
+                printf("%8.2fx ", rate / baseline);
+            }
+            else
+            {
+                printf("%9s ", "-");
+            }
+            printf("%12.1f %6.1f%%", result.peak_rss / (1024.0 * 1024.0), 100 * result.fragmentation);
+            if(result.failed_calls)
+            {
+                printf(" (%zu calls failed)", result.failed_calls);
+            }
+            if(result.corrupted_blocks)
+            {
+                printf(" (%zu blocks corrupted)", result.corrupted_blocks);
+                status_code = 1;
+            }
+            printf("\n");
+        }
+    }
+    for(const _BenchAllocator* alloc : _allocators)
+    {
+        if(alloc->check != nullptr && _isSelected(alloc, argc, argv))
+        {
+            bool passed = _runCheck(alloc);
+            printf("%-20s %-10s %s\n", "check", alloc->name, passed? "passed" : "failed");
+            status_code = passed? status_code : 1;
+        }
+    }
+    return status_code;
+}
+// $$$$$$$$$$ Driver $$$$$$$$$$ //
\ No newline at end of file
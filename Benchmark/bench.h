@@ -0,0 +1,27 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+// Every header that the allocator levels include. They are included here, at global scope, so that when a level is
+// wrapped in a namespace of its own (see level_N.cpp) its #includes are no-ops. malloc_4.h has all the includes of
+// malloc_4.cpp, which cover those of the other levels.
+#include "../Source/malloc_4.h"
+
+// The interface every allocator is benchmarked through. Functions that a level does not have are nullptr.
+struct _BenchAllocator
+{
+    const char* name;
+    void* (*smalloc)(size_t size);
+    void (*sfree)(void* p);
+    void* (*srealloc)(void* oldp, size_t size);
+    bool thread_safe; // Otherwise the calls of concurrent threads are serialized by the benchmark.
+    bool uses_sbrk; // The level grows the program break, which glibc malloc must then keep off.
+    void (*heap_stats)(size_t* heap_bytes, size_t* free_bytes); // The size of the heap (with its metadata) and its free part.
+    bool (*check)(); // Checks the calls of the level that the workloads do not make, and returns false if one fails.
+};
+
+extern const _BenchAllocator _bench_glibc;
+extern const _BenchAllocator _bench_malloc_1;
+extern const _BenchAllocator _bench_malloc_2;
+extern const _BenchAllocator _bench_malloc_3;
+extern const _BenchAllocator _bench_malloc_4;
+
+#endif
\ No newline at end of file
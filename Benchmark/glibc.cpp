@@ -0,0 +1,27 @@
+// The glibc allocator, as the baseline of the levels.
+#include "bench.h"
+#include <malloc.h>
+
+static void* _smalloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void _sfree(void* p)
+{
+    free(p);
+}
+
+static void* _srealloc(void* oldp, size_t size)
+{
+    return realloc(oldp, size);
+}
+
+static void _heapStats(size_t* heap_bytes, size_t* free_bytes)
+{
+    struct mallinfo2 info = mallinfo2();
+    *heap_bytes = info.arena + info.hblkhd;
+    *free_bytes = info.fordblks;
+}
+
+const _BenchAllocator _bench_glibc = { "glibc", _smalloc, _sfree, _srealloc, true, false, _heapStats, nullptr };
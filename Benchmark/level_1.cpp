@@ -0,0 +1,18 @@
+// malloc_1, in a namespace of its own so that all the levels can be linked into the benchmark together.
+#include "bench.h"
+
+namespace _level1
+{
+#include "../Source/malloc_1.cpp"
+}
+
+// malloc_1 keeps no statistics, but its heap is all that it moved the program break by.
+static char* _start_brk = static_cast<char*>(sbrk(0));
+
+static void _heapStats(size_t* heap_bytes, size_t* free_bytes)
+{
+    *heap_bytes = static_cast<char*>(sbrk(0)) - _start_brk;
+    *free_bytes = 0;
+}
+
+const _BenchAllocator _bench_malloc_1 = { "malloc_1", _level1::smalloc, nullptr, nullptr, false, true, _heapStats, nullptr };
@@ -0,0 +1,20 @@
+// malloc_2, in a namespace of its own so that all the levels can be linked into the benchmark together.
+#include "bench.h"
+
+namespace _level2
+{
+#include "../Source/malloc_2.cpp"
+}
+
+static void _sfree(void* p)
+{
+    _level2::sfree(p);
+}
+
+static void _heapStats(size_t* heap_bytes, size_t* free_bytes)
+{
+    *heap_bytes = _level2::_num_allocated_bytes() + _level2::_num_meta_data_bytes();
+    *free_bytes = _level2::_num_free_bytes();
+}
+
+const _BenchAllocator _bench_malloc_2 = { "malloc_2", _level2::smalloc, _sfree, _level2::srealloc, false, true, _heapStats, nullptr };
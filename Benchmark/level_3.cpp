@@ -0,0 +1,20 @@
+// malloc_3, in a namespace of its own so that all the levels can be linked into the benchmark together.
+#include "bench.h"
+
+namespace _level3
+{
+#include "../Source/malloc_3.cpp"
+}
+
+static void _sfree(void* p)
+{
+    _level3::sfree(p);
+}
+
+static void _heapStats(size_t* heap_bytes, size_t* free_bytes)
+{
+    *heap_bytes = _level3::_num_allocated_bytes() + _level3::_num_meta_data_bytes();
+    *free_bytes = _level3::_num_free_bytes();
+}
+
+const _BenchAllocator _bench_malloc_3 = { "malloc_3", _level3::smalloc, _sfree, _level3::srealloc, false, true, _heapStats, nullptr };
@@ -0,0 +1,47 @@
+// malloc_4, in a namespace of its own so that all the levels can be linked into the benchmark together.
+#include "bench.h"
+
+namespace _level4
+{
+#include "../Source/malloc_4.cpp"
+}
+
+static void _sfree(void* p)
+{
+    _level4::sfree(p);
+}
+
+static void _heapStats(size_t* heap_bytes, size_t* free_bytes)
+{
+    *heap_bytes = _level4::_num_allocated_bytes() + _level4::_num_meta_data_bytes();
+    *free_bytes = _level4::_num_free_bytes();
+}
+
+// sfree_batch() must free a block once, even if its pointer is repeated in the batch: for a slab object, a heap block
+// and a mmapped block, the number of live blocks drops by the number of distinct pointers.
+static bool _check()
+{
+    size_t sizes[] = { 64, 4000, 300000 };
+    for(size_t size : sizes)
+    {
+        void* a = _level4::smalloc(size);
+        void* guard = _level4::smalloc(size); // (Keeps a and b apart)
+        void* b = _level4::smalloc(size);
+        if(a == nullptr || guard == nullptr || b == nullptr)
+        {
+            return false;
+        }
+        size_t live = _level4::_num_allocated_blocks() - _level4::_num_free_blocks();
+        void* batch[] = { b, a, a, b, a };
+        _level4::sfree_batch(batch, 5);
+        if(_level4::_num_allocated_blocks() - _level4::_num_free_blocks() != live - 2)
+        {
+            return false;
+        }
+        _level4::sfree(guard);
+    }
+    return true;
+}
+
+const _BenchAllocator _bench_malloc_4 = { "malloc_4", _level4::smalloc, _sfree, _level4::srealloc, true, false, _heapStats,
+    _check };
@@ -0,0 +1,253 @@
+// Replays a trace recorded by malloc_4 (see _set_trace_file() in smalloc_trace.h) against one of the allocators:
+//
+//     g++ -std=c++17 -O2 -pthread -o replay replay.cpp glibc.cpp level_1.cpp level_2.cpp level_3.cpp level_4.cpp
+//     ./replay <trace> <allocator> [points]
+//
+// The calls are replayed by a single thread, in the order of the trace: every kind of allocation through smalloc()
+// (a calloc also clears its block, and the alignment of a memalign is dropped, since only malloc_4 has smemalign()),
+// the reallocations through srealloc() and the frees through sfree(). The replay is deterministic: the same trace
+// makes the same calls on every allocator.
+// It reports the time spent in the replayed calls, the peak heap (the bytes the allocator accounts for, with their
+// metadata: _num_allocated_bytes() + _num_meta_data_bytes() for malloc_2..4), and the fragmentation curve: at points
+// evenly spaced operations, the live bytes, the heap and the share of the heap that does not hold live bytes.
+#include "bench.h"
+#include <cstdio>
+#include <vector>
+#include <unordered_map>
+#include <malloc.h>
+#include <sys/stat.h>
+
+#define _DEFAULT_POINTS 20
+#define _STATS_INTERVAL 64 // The heap is sampled every this many operations, outside of the timed calls.
+#define _NO_ID UINT64_MAX
+
+static const _BenchAllocator* const _allocators[] = { &_bench_glibc, &_bench_malloc_1, &_bench_malloc_2, &_bench_malloc_3,
+    &_bench_malloc_4 };
+
+// A call of the trace, with the addresses of its blocks replaced by ids (a block keeps its id when it is reallocated).
+struct _ReplayOp
+{
+    uint32_t op;
+    uint32_t size;
+    uint64_t id;
+    uint64_t old_id;
+};
+
+// A point of the fragmentation curve.
+struct _CurvePoint
+{
+    size_t op;
+    size_t live_bytes;
+    size_t heap_bytes;
+};
+
+static uint64_t _now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Read the trace at path into ops. Return the number of block ids, or 0 if the trace can not be read.
+// An address that is freed while not live, or allocated while still live, is counted in unmatched. That happens only
+// when a srealloc() that moved its block raced with another thread that got the old block.
+static uint64_t _loadTrace(const char* path, std::vector<_ReplayOp>* ops, size_t* unmatched)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(_TraceHeader))
+    {
+        fprintf(stderr, "%s: can not read the trace\n", path);
+        return 0;
+    }
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: can not map the trace\n", path);
+        return 0;
+    }
+    const _TraceHeader* header = static_cast<const _TraceHeader*>(mapping);
+    if(memcmp(header->magic, _TRACE_MAGIC, sizeof(_TRACE_MAGIC)) != 0 || header->version != _TRACE_VERSION ||
+        header->record_size != sizeof(_TraceRecord))
+    {
+        fprintf(stderr, "%s: not a trace of this version\n", path);
+        munmap(mapping, st.st_size);
+        return 0;
+    }
+    const _TraceRecord* records = reinterpret_cast<const _TraceRecord*>(header + 1);
+    size_t num_records = (st.st_size - sizeof(_TraceHeader)) / sizeof(_TraceRecord);
+
+    std::unordered_map<uint64_t, uint64_t> live; // The id of every live address.
+    uint64_t next_id = 0;
+    *unmatched = 0;
+    ops->reserve(num_records);
+    for(size_t i = 0; i < num_records; i++)
+    {
+        const _TraceRecord& record = records[i];
+        _ReplayOp op = { record.op, record.size, _NO_ID, _NO_ID };
+        if(record.op == _TRACE_FREE || record.op == _TRACE_REALLOC)
+        {
+            uint64_t address = record.op == _TRACE_FREE? record.ptr : record.old_ptr;
+            auto it = live.find(address);
+            if(it == live.end())
+            {
+                (*unmatched)++;
+                if(record.op == _TRACE_FREE)
+                {
+                    continue;
+                }
+            }
+            else
+            {
+                op.old_id = it->second;
+                live.erase(it);
+            }
+        }
+        if(record.op != _TRACE_FREE)
+        {
+            op.id = next_id++;
+            auto inserted = live.emplace(record.ptr, op.id);
+            if(!inserted.second)
+            {
+                (*unmatched)++;
+                inserted.first->second = op.id;
+            }
+        }
+        ops->push_back(op);
+    }
+    munmap(mapping, st.st_size);
+    return next_id;
+}
+
+int main(int argc, char* argv[])
+{
+    const _BenchAllocator* alloc = nullptr;
+    for(int i = 0; argc > 2 && i < int(sizeof(_allocators) / sizeof(_allocators[0])); i++)
+    {
+        if(strcmp(argv[2], _allocators[i]->name) == 0)
+        {
+            alloc = _allocators[i];
+        }
+    }
+    size_t points = argc > 3? strtoull(argv[3], nullptr, 10) : _DEFAULT_POINTS;
+    if(alloc == nullptr || points == 0)
+    {
+        fprintf(stderr, "usage: %s <trace> <glibc|malloc_1|malloc_2|malloc_3|malloc_4> [points]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<_ReplayOp> ops;
+    size_t unmatched;
+    uint64_t num_ids = _loadTrace(argv[1], &ops, &unmatched);
+    if(num_ids == 0)
+    {
+        return 1;
+    }
+
+    // Everything the replay needs is allocated before the first replayed call, so that it does not move the program
+    // break under a level that uses sbrk(). (And anything glibc still allocates is mmapped)
+    std::vector<void*> blocks(num_ids, nullptr);
+    std::vector<uint32_t> sizes(num_ids, 0);
+    std::vector<_CurvePoint> curve;
+    curve.reserve(points + 2);
+    if(alloc->uses_sbrk)
+    {
+        mallopt(M_MMAP_THRESHOLD, 0);
+    }
+
+    size_t live_bytes = 0, peak_live = 0, peak_heap = 0, failed_calls = 0;
+    size_t heap_bytes = 0, free_bytes = 0;
+    size_t point_interval = std::max<size_t>(ops.size() / points, _STATS_INTERVAL);
+    uint64_t elapsed = 0;
+    for(size_t begin = 0; begin < ops.size(); begin += _STATS_INTERVAL)
+    {
+        size_t end = begin + _STATS_INTERVAL < ops.size()? begin + _STATS_INTERVAL : ops.size();
+        uint64_t start = _now();
+        for(size_t i = begin; i < end; i++)
+        {
+            const _ReplayOp& op = ops[i];
+            void* p = nullptr;
+            switch(op.op)
+            {
+            case _TRACE_MALLOC:
+            case _TRACE_CALLOC:
+            case _TRACE_MEMALIGN:
+                p = alloc->smalloc(op.size);
+                if(p && op.op == _TRACE_CALLOC)
+                {
+                    memset(p, 0, op.size);
+                }
+                break;
+            case _TRACE_REALLOC:
+                if(op.old_id == _NO_ID || blocks[op.old_id] == nullptr)
+                {
+                    p = alloc->smalloc(op.size);
+                }
+                else if(alloc->srealloc)
+                {
+                    p = alloc->srealloc(blocks[op.old_id], op.size);
+                }
+                else
+                {
+                    // (Without a srealloc(), the old block is copied and leaked)
+                    p = alloc->smalloc(op.size);
+                    if(p)
+                    {
+                        memcpy(p, blocks[op.old_id], std::min(op.size, sizes[op.old_id]));
+                    }
+                }
+                if(p && op.old_id != _NO_ID && blocks[op.old_id])
+                {
+                    live_bytes -= sizes[op.old_id];
+                    blocks[op.old_id] = nullptr;
+                }
+                break;
+            case _TRACE_FREE:
+                if(blocks[op.old_id])
+                {
+                    if(alloc->sfree)
+                    {
+                        alloc->sfree(blocks[op.old_id]);
+                    }
+                    live_bytes -= sizes[op.old_id];
+                    blocks[op.old_id] = nullptr;
+                }
+                continue;
+            default:
+                continue;
+            }
+            if(p == nullptr)
+            {
+                failed_calls++;
+                continue;
+            }
+            blocks[op.id] = p;
+            sizes[op.id] = op.size;
+            live_bytes += op.size;
+            peak_live = std::max(peak_live, live_bytes);
+        }
+        elapsed += _now() - start;
+
+        alloc->heap_stats(&heap_bytes, &free_bytes);
+        peak_heap = std::max(peak_heap, heap_bytes);
+        if(end == ops.size() || end / point_interval != begin / point_interval)
+        {
+            curve.push_back({ end, live_bytes, heap_bytes });
+        }
+    }
+
+    printf("allocator:        %s\n", alloc->name);
+    printf("operations:       %zu (%zu unmatched in the trace, %zu failed)\n", ops.size(), unmatched, failed_calls);
+    printf("time:             %.3f ms (%.1f ns per operation)\n", elapsed / 1e6, double(elapsed) / ops.size());
+    printf("peak live bytes:  %zu\n", peak_live);
+    printf("peak heap bytes:  %zu\n", peak_heap);
+    printf("\n%12s %14s %14s %8s\n", "operation", "live bytes", "heap bytes", "frag");
+    for(const _CurvePoint& point : curve)
+    {
+        double fragmentation = point.heap_bytes > point.live_bytes?
+            double(point.heap_bytes - point.live_bytes) / point.heap_bytes : 0;
+        printf("%12zu %14zu %14zu %7.1f%%\n", point.op, point.live_bytes, point.heap_bytes, 100 * fragmentation);
+    }
+    return 0;
+}
\ No newline at end of file
@@ -292,6 +292,7 @@ void* scalloc(size_t num, size_t size)
 void* sfree(void* p)
 {
     _AllocList::getInstance().sfree(p);
+    return nullptr;
 }
 
 void* srealloc(void* oldp, size_t size)
@@ -10,7 +10,7 @@
 #define _MIN_SPLIT _HIST_SIZE
 
 #define MAX_ALLOC_SIZE 100000000
-#define SIZE_TO_INDEX(size) (size == (_MAX_ALLOC + 1)? (_HIST_SIZE - 1) : size/_LIST_RANGE)
+#define SIZE_TO_INDEX(size) ((size) > _MAX_ALLOC? (_HIST_SIZE - 1) : (size)/_LIST_RANGE) // Merged free blocks above _MAX_ALLOC share the last list.
 #define IS_MMAPPED(size) (size > _MAX_ALLOC)
 
 // The metadata struct of each allocated block
@@ -18,6 +18,7 @@ struct _MallocMetaData
 {
     size_t size;
     bool is_free;
+    bool is_mmapped; // Set for the mmapped blocks. (A merged heap block may also be larger than _MAX_ALLOC)
     _MallocMetaData* next;
     _MallocMetaData* prev;
     _MallocMetaData* next_hist;
@@ -62,6 +63,7 @@ private:
         {
             .size = size,
             .is_free = is_free,
+            .is_mmapped = false,
             .next = next,
             .prev = prev
         };
@@ -83,6 +85,7 @@ private:
         }
         metadata->size = size;
         metadata->is_free = is_free;
+        metadata->is_mmapped = false;
         metadata->next = next;
         metadata->prev = prev;
     }
@@ -160,6 +163,8 @@ private:
             assert(hist[index].tail == nullptr);
             hist[index].head = to_insert;
             hist[index].tail = to_insert;
+            to_insert->next_hist = nullptr;
+            to_insert->prev_hist = nullptr;
             return;
         }
 
@@ -237,7 +242,7 @@ private:
     // ********** Mmap List Methods ********** //
     void mmapInsert(_MallocMetaData* to_insert)
     {
-        if (!to_insert || !IS_MMAPPED(to_insert->size))
+        if (!to_insert || !to_insert->is_mmapped)
         {
             return;
         }
@@ -613,6 +618,7 @@ public:
                 return nullptr;
             }
             setMetaData(reinterpret_cast<_MallocMetaData*>(ptr), size, false, nullptr, nullptr);
+            reinterpret_cast<_MallocMetaData*>(ptr)->is_mmapped = true;
             mmapInsert(reinterpret_cast<_MallocMetaData*>(ptr));
 
             // Update statistics:
@@ -641,7 +647,7 @@ public:
         {
             return;
         }
-        if(!IS_MMAPPED(ptr->size))
+        if(!ptr->is_mmapped)
         {
             ptr->is_free = true;
 
@@ -663,7 +669,7 @@ public:
 
             // Unmap region:
             mmapRemove(ptr);
-            munmap(p, ptr->size + _METADATA_SIZE);
+            munmap(ptr, ptr->size + _METADATA_SIZE); // (The mapping starts at the metadata)
         }
     }
 
@@ -681,7 +687,7 @@ public:
         _MallocMetaData* oldmeta = reinterpret_cast<_MallocMetaData*>(getMetaData(oldp));
         size_t old_size = oldmeta->size;
 
-        if(!IS_MMAPPED(old_size))
+        if(!oldmeta->is_mmapped)
         {
             // A: Try to reuse the current block without any merging:
             if(size <= oldmeta->size)
@@ -699,8 +705,9 @@ public:
                 return oldp;
             }
 
+            // B-D and the wilderness only grow the block up to _MAX_ALLOC, larger blocks are mmapped:
             // B: Try to merge with the adjacent block with the LOWER address:
-            else if(oldmeta->prev && oldmeta->prev->is_free && (oldmeta->size + oldmeta->prev->size + _METADATA_SIZE >= size))
+            else if(!IS_MMAPPED(size) && oldmeta->prev && oldmeta->prev->is_free && (oldmeta->size + oldmeta->prev->size + _METADATA_SIZE >= size))
             {
                 // We can merge the left block with our block.
                 _MallocMetaData* new_block = nullptr;
@@ -732,7 +739,7 @@ public:
             }
 
             // C: Try to merge with the adjacent block wit hthe HIGHER address:
-            else if(oldmeta->next && oldmeta->next->is_free && (oldmeta->size + oldmeta->next->size + _METADATA_SIZE >= size))
+            else if(!IS_MMAPPED(size) && oldmeta->next && oldmeta->next->is_free && (oldmeta->size + oldmeta->next->size + _METADATA_SIZE >= size))
             {
                 // We can merge the right block with our block.
                 _MallocMetaData* new_block = nullptr;
@@ -761,7 +768,7 @@ public:
             }
 
             // D: Try to merge all those THREE adjacent blocks together:
-            else if(oldmeta->prev && oldmeta->next && \
+            else if(!IS_MMAPPED(size) && oldmeta->prev && oldmeta->next && \
             oldmeta->prev->is_free && oldmeta->next->is_free && \
             (oldmeta->size + oldmeta->prev->size + oldmeta->next->size + 2 * _METADATA_SIZE >= size))
             {
@@ -775,8 +782,13 @@ public:
                 num_free_blocks -= 2;
                 num_allocated_blocks -= 2;
                 
+                histRemove(oldmeta->prev);
+                histRemove(oldmeta->next);
                 _mergeToSurrounding(oldmeta, &new_block, false);
 
+                // Copy the data to the new address (before the split, whose metadata may land on the old data):
+                memmove(getPayload(new_block), oldp, old_size);
+
                 _MallocMetaData* splitted = split(new_block, size);
                 if(splitted)
                 {
@@ -787,13 +799,11 @@ public:
                     num_meta_data_bytes += _METADATA_SIZE;
                     num_allocated_bytes -= _METADATA_SIZE;
                 }
-                // Copy the data to the new address:
-                memmove(getPayload(new_block), oldp, old_size);
                 return getPayload(new_block);
             }
 
             // A-D Failed, so check if we are trying to realloc wilderness, and extend it if so.
-            if(oldmeta == wilderness)
+            if(!IS_MMAPPED(size) && oldmeta == wilderness)
             {
                 return getPayload(_extendWilderness(size));
             }
@@ -816,6 +826,10 @@ public:
                 return oldp;
             }
             void* newp = smalloc(size);
+            if(!newp)
+            {
+                return nullptr;
+            }
             memmove(newp, oldp, old_size > size? size : old_size);
             sfree(oldp);
             return newp;
@@ -870,6 +884,7 @@ void* scalloc(size_t num, size_t size)
 void* sfree(void* p)
 {
     _AllocList::getInstance().sfree(p);
+    return nullptr;
 }
 
 void* srealloc(void* oldp, size_t size)
@@ -1,91 +1,352 @@
-#include <unistd.h>
-#include <cstring>
-#include <cassert>
-#include <sys/mman.h>
+#include "malloc_4.h"
 
-#define _METADATA_SIZE sizeof(_MallocMetaData) // = 48
-#define _LIST_RANGE 1024 // = 1KB
-#define _MAX_ALLOC 131071 // = 128KB, the maximum allocatable size on the heap with sbrk().
-#define _HIST_SIZE ((_MAX_ALLOC+1)/_LIST_RANGE) // = 128KB/1KB = 128
-#define _MIN_SPLIT _HIST_SIZE
+#define _METADATA_SIZE sizeof(_MallocMetaData) // = 16
+#define _MMAP_METADATA_SIZE (sizeof(_MmapLinks) + _METADATA_SIZE) // = 32, mmapped blocks also keep their list links.
+#define _MMAP_THRESHOLD_MAX (32 * 1024 * 1024) // The adaptive mmap threshold never rises above this.
+#define _MIN_SPLIT 128
+#define _MIN_PAYLOAD (sizeof(_HistNode) + sizeof(size_t)) // A heap block must be able to hold its tree links and footer once it is freed.
+
+// The histogram is two-level, TLSF style: a first level list per power of 2, split into _SL_COUNT second level lists.
+// Sizes below _SMALL_BLOCK share the first first-level row, in lists _SMALL_BLOCK/_SL_COUNT (= 8) bytes apart.
+#define _SL_LOG 5
+#define _SL_COUNT (1 << _SL_LOG) // = 32
+#define _FL_SHIFT 8
+#define _SMALL_BLOCK (1 << _FL_SHIFT) // = 256
+#define _FL_COUNT 24 // Covers sizes up to 2GB, larger (merged) free blocks all go to the last list.
+#define _HIST_SIZE (_FL_COUNT * _SL_COUNT) // = 768
+static_assert(_HIST_SIZE == _HEAP_BUCKETS, "The heap walk reports a bucket per hist list");
+
+#define _PAGE_SIZE 4096
+#define _TRIM_THRESHOLD (256 * 1024) // The default size a free wilderness must reach to be trimmed back to the OS.
+#define _TOP_PAD (64 * 1024) // The default number of bytes a trim leaves in the wilderness.
+#define _HEAP_CHUNK (64 * 1024) // The default size of the first chunk the heap is grown by.
+#define _HEAP_CHUNK_MAX (1024 * 1024) // The default size the growth chunks double up to.
+#define _RELEASE_THRESHOLD (64 * 1024) // The size from which the inner pages of a free heap block are released.
+#define _SEGMENT_SIZE (64UL * 1024 * 1024) // The address space an arena reserves for a heap segment at a time.
+#define _MAX_ARENAS 8 // Threads are spread over up to this many arenas (one per CPU).
+#define _HUGE_PAGE_SIZE (2UL * 1024 * 1024) // Huge pages back whole aligned regions of this size, when enabled.
+
+#define _MMAP_CACHE_BINS 16 // Bin i holds the cached mappings of 2^(17+i) to 2^(18+i) bytes (the last one, all above).
+#define _MMAP_CACHE_LIMIT (32 * 1024 * 1024) // The default number of bytes the mmap cache may hold.
+#define _MMAP_CACHE_MAX_AGE 1000 // The default number of milliseconds a mapping is kept in the mmap cache.
+#define _MMAP_CACHE_MAX_WASTE 2 // A cached mapping is reused if it is at most length/2^_MMAP_CACHE_MAX_WASTE bytes too long.
 
 #define MAX_ALLOC_SIZE 100000000
-#define SIZE_TO_INDEX(size) (size == (_MAX_ALLOC + 1)? (_HIST_SIZE - 1) : size/_LIST_RANGE)
-#define IS_MMAPPED(size) (size > _MAX_ALLOC)
+
+// The flags of a block:
+#define _BLOCK_FREE 1UL
+#define _BLOCK_PREV_FREE 2UL // The block right before this one in the heap is free, so its footer is valid.
+#define _BLOCK_MMAPPED 4UL // The block lives in its own mapping (such a block is never free).
+#define _BLOCK_FENCE 8UL // The end of a heap segment. Never free; its size holds the address of the next segment (or 0).
+#define _BLOCK_RELEASED 16UL // A free block whose inner pages were given back to the OS with madvise().
+#define _BLOCK_RECYCLED 32UL // A mmapped block that reuses a cached mapping, so its payload is not zeroed.
+#define _BLOCK_HUGE 64UL // A mmapped block whose mapping is backed by huge pages.
+#define _BLOCK_HUGETLB 128UL // A huge mmapped block mapped with MAP_HUGETLB, its length is a multiple of _HUGE_PAGE_SIZE.
+#define _BLOCK_SAMPLED 256UL // A block in use whose allocation was sampled by the heap profiler.
+#define _WASTE_SHIFT 16 // The flags of a heap block in use keep its size minus the bytes it was allocated for from this bit.
+#define _WASTE_MASK (255UL << _WASTE_SHIFT)
 #define ROUND_UP(size) ((size + 7)&(-8))
+#define ROUND_UP_PAGE(size) (((size) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1))
+#define ROUND_UP_HUGE(size) (((size) + _HUGE_PAGE_SIZE - 1) & ~(_HUGE_PAGE_SIZE - 1))
+#define MMAP_LENGTH(size) ROUND_UP_PAGE((size) + _MMAP_METADATA_SIZE) // The length of the mapping of a mmapped block.
+
+#define _TCACHE_DISABLED (reinterpret_cast<_ThreadCache*>(-1)) // Marks a thread that must use the shared heap directly.
+#define SIZE_TO_CLASS(size) ((size)/8 - 1)
+#define CLASS_TO_SIZE(index) (((index) + 1)*8)
+
+#define _RUN_SHIFT 16
+#define _RUN_SIZE (1UL << _RUN_SHIFT) // = 64KB, the size (and alignment) of a slab run.
+#define _RUN_HEADER_SIZE ((sizeof(_SlabRun) + 15) & ~15UL) // The metadata shared by all the objects of a run (see malloc_4.h for the 16).
+#define _MAX_FREE_RUNS 16 // The number of empty runs kept mapped for reuse.
+#define RUN_OF(p) (reinterpret_cast<_SlabRun*>(reinterpret_cast<uintptr_t>(p) & ~(_RUN_SIZE - 1)))
+
+#define _PAGEMAP_LEAF_BITS 16
+#define _PAGEMAP_ROOT_SIZE (1UL << (48 - _RUN_SHIFT - _PAGEMAP_LEAF_BITS)) // Covers the 48 bit user address space.
+#define _PAGEMAP_LEAF_SIZE (1UL << _PAGEMAP_LEAF_BITS)
+
+// What a _RUN_SIZE aligned chunk of the address space holds, according to the page map:
+#define _CHUNK_NONE 0 // Not ours, or the mapping of a mmapped block.
+#define _CHUNK_RUN 1 // A slab run.
+#define _CHUNK_ARENA 2 // A heap segment of the arena _CHUNK_ARENA + index.
 
-// The metadata struct of each allocated block
+#define _TRACE_RING_SIZE (1UL << 16) // The number of records the trace buffer holds (a power of 2).
+#define _TRACE_WRITER_SLEEP 1000000 // The nanoseconds the trace writer sleeps when there is nothing to write.
+
+#define _PROFILE_MAX_DEPTH 64 // The number of frames kept of the call stack of a sampled allocation.
+#define _PROFILE_TABLE_SIZE 4096 // The number of lists of the hash tables of the heap profiler (a power of 2).
+#define _PROFILE_CHUNK (64 * 1024) // The size of the mappings the heap profiler carves its records from.
+#define _PROFILE_LINE_SIZE (_PROFILE_MAX_DEPTH * 19 + 128) // The longest line of a heap profile (a stack of 0x... addresses).
+#define _SAMPLE_RECHECK (1024 * 1024) // The bytes a thread allocates between checks of the sample period, while it is off.
+
+#define _INSTRUMENT_STRIPES 16 // The number of copies of the instrumentation counters the threads are spread over.
+
+struct _ThreadCache;
+
+// The metadata struct of each allocated block: the header half of its boundary tag.
+// The heap blocks are laid out back to back, so the next block starts right after the payload.
+// A free heap block also stores its size in the last 8 bytes of its payload (the footer, the other half of the tag),
+// and sets _BLOCK_PREV_FREE in the next block, so that the previous block can be found when it is free.
 struct _MallocMetaData
 {
     size_t size;
-    size_t is_free;
+    size_t flags;
+};
+
+// The links of the (unordered) list of the mmapped blocks, kept right before their metadata.
+struct _MmapLinks
+{
     _MallocMetaData* next;
     _MallocMetaData* prev;
-    _MallocMetaData* next_hist;
+};
+
+// A mapping that is kept for reuse after its block was freed, written at the start of the mapping.
+struct _MmapCacheEntry
+{
+    size_t length; // The length of the whole mapping.
+    uint64_t cached_at; // In milliseconds.
+    _MmapCacheEntry* next_bin; // The entries of the same bin, newest first.
+    _MmapCacheEntry* prev_bin;
+    _MmapCacheEntry* newer; // All the entries by age.
+    _MmapCacheEntry* older;
+    bool huge; // The mapping is backed by huge pages.
+};
+
+// The links of a free block in its hist list, kept in the payload of the block.
+// Each list is a bitwise trie keyed by size: a node's children hold sizes whose next bit is 0 and 1 respectively,
+// while the node itself may have any size that shares the bits above them. Blocks of a size that is already
+// in the trie are only chained (by next_hist) to the node of that size.
+struct _HistNode
+{
+    _MallocMetaData* next_hist; // The circular list of the free blocks of the same size.
     _MallocMetaData* prev_hist;
+    _MallocMetaData* child[2];
+    _MallocMetaData* parent; // nullptr for the root.
+    size_t in_tree; // false for blocks that are only chained to the node of their size.
 };
 
 // The struct for the histogram of lists:
 struct _ListInfo
 {
     int size = 0;
-    _MallocMetaData* head = nullptr;
-    _MallocMetaData* tail = nullptr;
+    _MallocMetaData* root = nullptr;
 };
 
-// The singleton class of the allocator, used to manage all allocations:
-class _AllocList
+// A free object in a slab run. It is laid over the object itself, so free objects cost no extra memory.
+struct _CachedBlock
 {
-private:
-    _MallocMetaData* head; // The head of the mem-address-ordered doubly linked list
-    _MallocMetaData* mmap_head; // The head of the mmapped structs' unordered doubly linked list
-    _ListInfo hist[_HIST_SIZE]; // The sizes histogram of the size-ordered doubly linked list
+    _CachedBlock* next;
+};
 
-    _MallocMetaData* wilderness;
-    size_t num_free_blocks;
-    size_t num_free_bytes;
-    size_t num_allocated_blocks;
-    size_t num_allocated_bytes;
-    size_t num_meta_data_bytes;
-    size_t size_meta_data;
+// The header of a slab run: a _RUN_SIZE aligned region that holds objects of a single size class.
+// The objects carry no metadata of their own, the run is found from an object by masking its address.
+// A run is owned by one thread cache, which is the only one to touch its free list.
+// Runs whose owner exited are "abandoned" to the shared heap and handled under global_lock until adopted again.
+struct _SlabRun
+{
+    size_t size; // The size of every object in the run.
+    int index; // The size class of the run.
+    size_t capacity; // The number of objects that fit in the run.
+    size_t num_used; // The number of objects that were handed out and not freed back to the run.
+    _CachedBlock* free_list; // Freed objects of the run.
+    char* bump; // The objects from bump to end were never handed out.
+    char* end;
+    std::atomic<_ThreadCache*> owner; // nullptr if the run is abandoned.
+    _SlabRun* next; // The next run in the owner's list (or the abandoned list) of the class.
+    _SlabRun* prev;
+};
 
-    _AllocList() : 
-    head(nullptr), wilderness(nullptr), num_free_blocks(0), num_free_bytes(0), num_allocated_blocks(0),
-    num_allocated_bytes(0), num_meta_data_bytes(0), size_meta_data(_METADATA_SIZE) { }
+// The per-thread cache of small objects, sorted by size class.
+// Only the owning thread allocates from its runs; other threads hand objects back through remote_head.
+struct _ThreadCache
+{
+    _SlabRun* runs[_TCACHE_CLASSES] = { }; // Per class, the owned runs that have free objects.
+    _SlabRun* full_runs = nullptr; // The owned runs (of all classes) that have no free objects.
+    std::atomic<_CachedBlock*> remote_head { nullptr }; // Objects freed by other threads, drained by the owner.
 
-    _AllocList(_AllocList& other) = delete; // disable copy ctor
-    void operator=(_AllocList const &) = delete; // disable = operator
+    // Statistics, read by other threads through the stats getters:
+    std::atomic<size_t> num_blocks { 0 }; // The free objects in the owned runs.
+    std::atomic<size_t> num_bytes { 0 };
+    std::atomic<size_t> num_remote_blocks { 0 };
+    std::atomic<size_t> num_remote_bytes { 0 };
+
+    _ThreadCache* next = nullptr; // The next cache in the list of all caches ever created.
+    bool in_use = false; // Caches of threads that exited are kept and reused by new threads.
+};
+
+
+// The allocations of the heap profiler with the same call stack.
+struct _ProfileBucket
+{
+    _ProfileBucket* next; // The buckets of the same hash table list.
+    uint64_t hash;
+    size_t depth;
+    size_t alloc_count; // The sampled allocations, and their bytes.
+    size_t alloc_bytes;
+    size_t free_count; // The sampled allocations that were freed since, and their bytes.
+    size_t free_bytes;
+    void* stack[_PROFILE_MAX_DEPTH];
+};
+
+// A sampled block that is still in use.
+struct _ProfileSample
+{
+    _ProfileSample* next; // The samples of the same hash table list, or the next free sample.
+    void* p;
+    size_t size;
+    _ProfileBucket* bucket;
+};
 
-    // Create a metadata struct.
-    _MallocMetaData createMetaData(size_t size, bool is_free, _MallocMetaData* next, _MallocMetaData* prev)
+// The statistics of the heap of an arena.
+struct _HeapStats
+{
+    size_t free_blocks = 0;
+    size_t free_bytes = 0;
+    size_t allocated_blocks = 0;
+    size_t allocated_bytes = 0;
+    size_t meta_data_bytes = 0;
+    size_t trimmed_bytes = 0;
+    size_t released_bytes = 0;
+    size_t reserved_bytes = 0;
+    size_t huge_bytes = 0;
+    size_t round_up_bytes = 0;
+    size_t leftover_bytes = 0;
+};
+
+// The page map: one byte per _RUN_SIZE aligned chunk of the address space, which tells what the chunk holds (_CHUNK_*).
+// Leaves are mapped on demand and never unmapped, so it can be read without holding any lock.
+static std::atomic<std::atomic<uint8_t>*> _pagemap[_PAGEMAP_ROOT_SIZE];
+
+// The cache of the calling thread. Created on the first small allocation of the thread.
+static thread_local _ThreadCache* _tcache = nullptr;
+
+class _Arena;
+
+// The arena of the calling thread. Assigned on the first heap allocation of the thread.
+static thread_local _Arena* _tarena = nullptr;
+
+// Whether the calls of the user functions are traced. Checked on every call, so it is kept out of _Tracer.
+static std::atomic<bool> _tracing(false);
+
+// Forget the sample of a block that is freed or resized, see Heap Profiling. The arenas and the allocator call it
+// while they hold their locks, so the heap profiler never calls them back.
+static void _profileFree(void* p);
+// Hold the lock of the heap profiler across fork(), after all the other locks.
+static void _profileForkLock();
+static void _profileForkUnlock();
+
+// ********** Instrumentation ********** //
+// The counters of smalloc_instrument.h, kept only when compiled with -DSMALLOC_INSTRUMENT.
+// Each thread adds to one of _INSTRUMENT_STRIPES copies of them (in lines of their own), so that the threads rarely
+// share a line. A snapshot sums the copies.
+#ifdef SMALLOC_INSTRUMENT
+struct alignas(64) _InstrumentStripe
+{
+    std::atomic<uint64_t> paths[_PATH_COUNT];
+    std::atomic<uint64_t> latency[_OP_COUNT][_LATENCY_BUCKETS];
+};
+
+static _InstrumentStripe _instrument[_INSTRUMENT_STRIPES];
+static std::atomic<size_t> _instrument_next_stripe(0);
+static thread_local _InstrumentStripe* _tstripe = nullptr;
+
+static inline _InstrumentStripe* _instrumentStripe()
+{
+    if(_tstripe == nullptr)
     {
-        _MallocMetaData res = 
-        {
-            .size = size,
-            .is_free = is_free,
-            .next = next,
-            .prev = prev
-        };
-        return res;
+        _tstripe = &_instrument[_instrument_next_stripe.fetch_add(1, std::memory_order_relaxed) % _INSTRUMENT_STRIPES];
+    }
+    return _tstripe;
+}
+
+// The cycle counter (or nanoseconds, where there is none).
+static inline uint64_t _cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline void _recordLatency(int op, uint64_t cycles)
+{
+    int bucket = 63 - __builtin_clzll(cycles | 1);
+    if(bucket >= _LATENCY_BUCKETS)
+    {
+        bucket = _LATENCY_BUCKETS - 1;
     }
+    _instrumentStripe()->latency[op][bucket].fetch_add(1, std::memory_order_relaxed);
+}
 
+#define _COUNT_PATH(path) _instrumentStripe()->paths[path].fetch_add(1, std::memory_order_relaxed)
+#define _LATENCY_START(start) uint64_t start = _cycles()
+#define _LATENCY_END(op, start) _recordLatency(op, _cycles() - (start))
+#else
+#define _COUNT_PATH(path) ((void)0)
+#define _LATENCY_START(start) ((void)0)
+#define _LATENCY_END(op, start) ((void)0)
+#endif
+// $$$$$$$$$$ Instrumentation $$$$$$$$$$ //
+
+// The accessors of the metadata of the blocks, shared by the arenas and the allocator.
+class _BlockAccess
+{
+protected:
     inline _MallocMetaData* getMetaData(void* p)
     {
         return p == nullptr? nullptr : reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(p) - _METADATA_SIZE);
     }
 
-    // Set the metadata members. 
-    // NOTICE: The size variable SHOULD NOT include the metadata size.
-    void setMetaData(_MallocMetaData* metadata, size_t size, bool is_free, _MallocMetaData* next, _MallocMetaData* prev)
+    inline bool isFree(_MallocMetaData* metadata)
+    {
+        return metadata->flags & _BLOCK_FREE;
+    }
+
+    // Check whether the block was allocated with mmap() rather than on the heap.
+    // (The size can not tell, since heap blocks that could not be split may be larger than the mmap threshold)
+    inline bool isMmappedBlock(_MallocMetaData* metadata)
+    {
+        return metadata->flags & _BLOCK_MMAPPED;
+    }
+
+    // Return the block that follows a heap block in memory. (The wilderness is followed by the fence)
+    inline _MallocMetaData* getNext(_MallocMetaData* metadata)
     {
-        if(!metadata)
+        return reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(metadata) + _METADATA_SIZE + metadata->size);
+    }
+
+    // Return the block that precedes a heap block in memory if it is free, or nullptr if it is in use (or there is none).
+    inline _MallocMetaData* getFreePrev(_MallocMetaData* metadata)
+    {
+        if(!(metadata->flags & _BLOCK_PREV_FREE))
         {
-            return;
+            return nullptr;
+        }
+        size_t prev_size = *(reinterpret_cast<size_t*>(metadata) - 1); // The footer of the previous block.
+        return reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(metadata) - prev_size - _METADATA_SIZE);
+    }
+
+    // Mark a heap block as free or used, keeping its footer and the _BLOCK_PREV_FREE flag of the next block in sync.
+    void setFree(_MallocMetaData* metadata, bool is_free)
+    {
+        _MallocMetaData* next = getNext(metadata);
+        if(is_free)
+        {
+            metadata->flags |= _BLOCK_FREE;
+            *reinterpret_cast<size_t*>(reinterpret_cast<char*>(next) - sizeof(size_t)) = metadata->size;
+            next->flags |= _BLOCK_PREV_FREE;
+        }
+        else
+        {
+            metadata->flags &= ~_BLOCK_FREE;
+            next->flags &= ~_BLOCK_PREV_FREE;
         }
-        metadata->size = size;
-        metadata->is_free = is_free;
-        metadata->next = next;
-        metadata->prev = prev;
     }
 
     // Calculate the payload address by the metadata address.
@@ -94,792 +355,3867 @@ private:
         return metadata? reinterpret_cast<void*>(reinterpret_cast<char*>(metadata) + _METADATA_SIZE) : nullptr;
     }
 
-    // Return a malloc metadata that marks a free payload.
-    // - Argument 'bytes' will be the size of the requested new payload without the metadata size.
-    // - The search will be prioritized by size - through the histogram of lists.
-    // - If none exist, bytes is greater than _MAX_ALLOC(=128KB) - return nullptr.
-    // (Therefore, only use this function to search for blocks in the heap)
-    _MallocMetaData* getFreeBlock(size_t bytes)
+    // Return the list links that are kept right before the metadata of a mmapped block.
+    inline _MmapLinks* getMmapLinks(_MallocMetaData* metadata)
     {
-        if(bytes > _MAX_ALLOC)
-        {
-            return nullptr;
-        }
+        return reinterpret_cast<_MmapLinks*>(metadata) - 1;
+    }
 
-         // This will be the beginning index to search at. 
-         // No point in searching in any other list before, because it will definitely be of smaller sizes.
-        int index = SIZE_TO_INDEX(bytes);
-        _MallocMetaData* curr = nullptr;
+    // Return the start of the mapping of a mmapped block, and set length to its length.
+    // The mapping is made of the pages from the links to the end of the payload. (The links start it, unless the
+    // block is aligned, and then they may be anywhere in its first page)
+    void* mmapMapping(_MallocMetaData* metadata, size_t* length)
+    {
+        uintptr_t start = reinterpret_cast<uintptr_t>(getMmapLinks(metadata)) & ~(_PAGE_SIZE - 1);
+        *length = ROUND_UP_PAGE(reinterpret_cast<uintptr_t>(getPayload(metadata)) + metadata->size - start);
+        return reinterpret_cast<void*>(start);
+    }
+};
 
-        for(int i = index; i < _HIST_SIZE; i++)
+// The page map and the mapping of aligned regions, shared by the slab runs and the heap segments of the arenas.
+class _PageMap
+{
+protected:
+    // Set the kind (_CHUNK_*) of all the chunks of the region of length bytes at base (both multiples of _RUN_SIZE).
+    // Return false if a missing leaf of the page map could not be mapped.
+    bool pagemapSet(void* base, size_t length, uint8_t kind)
+    {
+        uintptr_t first = reinterpret_cast<uintptr_t>(base) >> _RUN_SHIFT;
+        for(uintptr_t chunk = first; chunk < first + (length >> _RUN_SHIFT); chunk++)
         {
-            if(hist[i].size <= 0)
+            uintptr_t root_index = chunk >> _PAGEMAP_LEAF_BITS;
+            if(root_index >= _PAGEMAP_ROOT_SIZE)
             {
-                continue;
+                return false;
             }
-            curr = hist[i].head; // head is not nullptr because size > 0.
-            while(curr)
+
+            std::atomic<uint8_t>* leaf = _pagemap[root_index].load(std::memory_order_acquire);
+            if(leaf == nullptr)
             {
-                // Check if this curr is able to contain the required bytes. 
-                // (It is definitely free because hist contains only free blocks)
-                if(curr->is_free && bytes <= curr->size)
+                if(kind == _CHUNK_NONE)
                 {
-                    return curr;
+                    continue;
                 }
+                void* ptr = mmap(NULL, _PAGEMAP_LEAF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(ptr == MAP_FAILED)
+                {
+                    return false;
+                }
+                leaf = reinterpret_cast<std::atomic<uint8_t>*>(ptr); // The mapping is zeroed, so all the chunks are _CHUNK_NONE.
 
-                curr = curr->next_hist;
+                // Arenas and slab runs are created under different locks, so two threads may race to add the same leaf:
+                std::atomic<uint8_t>* expected = nullptr;
+                if(!_pagemap[root_index].compare_exchange_strong(expected, leaf, std::memory_order_acq_rel))
+                {
+                    munmap(ptr, _PAGEMAP_LEAF_SIZE);
+                    leaf = expected;
+                }
             }
+            leaf[chunk & (_PAGEMAP_LEAF_SIZE - 1)].store(kind, std::memory_order_release);
         }
-
-        // We have searched all the relevant lists of free blocks, and found no matching block.
-        return nullptr;
+        return true;
     }
 
-    // Return the metadata of the highest addressed metadata in the heap.
-    // Return nullptr if the list is empty.
-    _MallocMetaData* getWilderness()
+    // Return the kind (_CHUNK_*) of the chunk that holds p. Does not need any lock.
+    uint8_t pagemapLookup(void* p)
     {
-        if(!head)
+        uintptr_t chunk = reinterpret_cast<uintptr_t>(p) >> _RUN_SHIFT;
+        uintptr_t root_index = chunk >> _PAGEMAP_LEAF_BITS;
+        if(root_index >= _PAGEMAP_ROOT_SIZE)
         {
-            return nullptr;
+            return _CHUNK_NONE;
         }
 
-        return wilderness;
+        std::atomic<uint8_t>* leaf = _pagemap[root_index].load(std::memory_order_acquire);
+        if(leaf == nullptr)
+        {
+            return _CHUNK_NONE;
+        }
+        return leaf[chunk & (_PAGEMAP_LEAF_SIZE - 1)].load(std::memory_order_acquire);
     }
 
-    // ********** Historgram Methods ********** //
-    void histInsert(_MallocMetaData* to_insert)
+    // Map a region of size bytes that starts at a multiple of alignment (a power of 2 that is a multiple of the page size).
+    // Extra flags (such as MAP_NORESERVE) may be given for the mapping.
+    void* mapAligned(size_t size, size_t alignment, int prot = PROT_READ | PROT_WRITE, int flags = 0)
     {
-        int size = to_insert->size;
-        int index = SIZE_TO_INDEX(size);
-        assert(index < _HIST_SIZE);
-
-        hist[index].size++; // Someone will definitely get in this list one way or another.
+        size_t length = size + alignment;
+        void* ptr = mmap(NULL, length, prot, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+        if(ptr == MAP_FAILED)
+        {
+            return nullptr;
+        }
 
-        if (hist[index].head == nullptr) // The list is empty at the corresponding index for size
+        // Unmap the slack before and after the aligned region:
+        uintptr_t start = reinterpret_cast<uintptr_t>(ptr);
+        uintptr_t aligned = (start + alignment - 1) & ~(alignment - 1);
+        if(aligned > start)
         {
-            assert(hist[index].tail == nullptr);
-            hist[index].head = to_insert;
-            hist[index].tail = to_insert;
-            return;
+            munmap(ptr, aligned - start);
+        }
+        if(start + length > aligned + size)
+        {
+            munmap(reinterpret_cast<void*>(aligned + size), start + length - (aligned + size));
         }
+        return reinterpret_cast<void*>(aligned);
+    }
 
-        _MallocMetaData* node = hist[index].head;
-        while(node)
+    /**
+     * Map a region of at least length bytes that is backed by huge pages, and set length to its actual length.
+     * - MAP_HUGETLB is tried first. It only works if the system has huge pages reserved, and rounds the length up
+     *   to whole huge pages. flags is then set to _BLOCK_HUGE | _BLOCK_HUGETLB.
+     * - Otherwise the region is _HUGE_PAGE_SIZE aligned and advised with MADV_HUGEPAGE, so that transparent huge
+     *   pages back its whole huge pages. flags is set to _BLOCK_HUGE (or to 0 if the kernel refused the advice).
+     * Return nullptr if the region could not be mapped.
+     */
+    void* mapHuge(size_t* length, size_t* flags)
+    {
+        void* ptr = mmap(NULL, ROUND_UP_HUGE(*length), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(ptr != MAP_FAILED)
         {
-            if(to_insert->size <= node->size)
-            {
-                if (node == hist[index].head) // The new node should be inserted before the current head
-                {
-                    to_insert->next_hist = hist[index].head;
-                    hist[index].head->prev_hist = to_insert;
-                    hist[index].head = to_insert;
-                    to_insert->prev_hist = nullptr;
-                    return;
-                }
-                // it should be inserted somewhere in the middle, before the current node (not head and not tail)
-                node->prev_hist->next_hist = to_insert;
-                to_insert->next_hist = node;
-                to_insert->prev_hist = node->prev_hist;
-                node->prev_hist = to_insert;
-                return;
-            }
-            node = node->next_hist;
+            *length = ROUND_UP_HUGE(*length);
+            *flags = _BLOCK_HUGE | _BLOCK_HUGETLB;
+            return ptr;
         }
 
-        // The new node should be last in the list
-        hist[index].tail->next_hist = to_insert;
-        to_insert->prev_hist = hist[index].tail;
-        to_insert->next_hist = nullptr;
-        hist[index].tail = to_insert;
-        return;
+        ptr = mapAligned(*length, _HUGE_PAGE_SIZE);
+        if(ptr == nullptr)
+        {
+            return nullptr;
+        }
+        *flags = madvise(ptr, *length, MADV_HUGEPAGE) == 0? _BLOCK_HUGE : 0;
+        return ptr;
     }
+};
 
-    void histRemove(_MallocMetaData* to_remove)
+// An arena: a heap of its own, with its own free blocks, lock and statistics.
+// The heap lives in segments of address space that the arena reserves with MAP_NORESERVE, and commits as its break
+// moves up (like the break of sbrk(), but private to the arena), so arenas never collide with each other or with
+// other users of the real break. Every chunk of a segment is marked as the arena's in the page map.
+class _Arena : private _BlockAccess, private _PageMap
+{
+private:
+    uint8_t id; // The index of the arena.
+    _MallocMetaData* head; // The first block of the first heap segment.
+    _ListInfo hist[_HIST_SIZE]; // The sizes histogram of the free blocks, a size-keyed trie per list
+    uint32_t fl_bitmap; // Bit fl is set if any list in the row fl of hist is not empty.
+    uint32_t sl_bitmap[_FL_COUNT]; // Bit sl of sl_bitmap[fl] is set if the list fl*_SL_COUNT+sl is not empty.
+
+    _MallocMetaData* wilderness;
+    _MallocMetaData* fence; // The fence at the end of the last heap segment, right after the wilderness.
+    size_t heap_reserve; // The bytes between the fence and the break, that the heap grows into before moving the break.
+    size_t heap_chunk; // The size of the next chunk the break is moved by.
+    size_t heap_chunk_min;
+    size_t heap_chunk_max;
+    char* segment_break; // The break of the current segment: the memory above it is not used yet.
+    char* segment_committed; // The memory from the break up to here is committed but not used.
+    char* segment_end;
+    char* heap_clean; // The memory of the current segment from here on was not written since the OS zeroed it.
+    bool segment_huge; // The current segment is advised to be backed by huge pages.
+    bool huge_pages; // New segments are backed by huge pages.
+    size_t num_free_blocks;
+    size_t num_free_bytes;
+    size_t num_allocated_blocks;
+    size_t num_allocated_bytes;
+    size_t num_meta_data_bytes;
+    size_t num_trimmed_bytes; // The total bytes given back to the OS by trimming the wilderness.
+    size_t num_released_bytes; // The free bytes that are currently released with madvise() (and so are not resident).
+    size_t num_huge_bytes; // The committed bytes of the segments that are backed by huge pages.
+    size_t num_round_up_bytes; // The bytes the blocks in use were rounded up by (to a multiple of 8 and to _MIN_PAYLOAD).
+    size_t num_leftover_bytes; // The bytes at the end of the blocks in use that were too few to split off.
+    size_t trim_threshold;
+    size_t top_pad;
+
+    mutable std::mutex heap_lock; // Guards the whole heap of the arena.
+
+    // Return a malloc metadata that marks a free payload.
+    // - Argument 'bytes' will be the size of the requested new payload without the metadata size.
+    // - The search will be prioritized by size - through the histogram of lists.
+    // - If none exist, return nullptr.
+    _MallocMetaData* getFreeBlock(size_t bytes)
     {
-        if (!to_remove)
+        // The list of bytes may hold blocks that are smaller than bytes, so it is searched for the best fit.
+        int index = histIndex(bytes);
+        _MallocMetaData* best = histBestFit(index, bytes);
+        if(best)
         {
-            return;
+            return best;
         }
-        int size = to_remove->size;
-        int index = SIZE_TO_INDEX(size);
-        assert(index < _HIST_SIZE);
 
-        hist[index].size--; // Remove will always be successful.
+        // Any block in a later list is large enough, so take the smallest one of the first non empty list:
+        index = histNextNonEmpty(index + 1);
+        return index < 0? nullptr : histTreeMin(hist[index].root);
+    }
 
-        if(to_remove == hist[index].head && to_remove == hist[index].tail)
+    // Return the metadata of the highest addressed metadata in the heap.
+    // Return nullptr if the list is empty.
+    _MallocMetaData* getWilderness()
+    {
+        if(!head)
         {
-            // This is the only member in the list. Remove it.
-            hist[index].head = nullptr;
-            hist[index].tail = nullptr;
-            return;
+            return nullptr;
         }
-        else if(to_remove == hist[index].head)
+
+        return wilderness;
+    }
+
+    // ********** Historgram Methods ********** //
+    // Return the index of the hist list that holds blocks of the given size.
+    int histIndex(size_t size)
+    {
+        if(size < _SMALL_BLOCK)
         {
-            // This is not the only member in the list, but it is the first. Remove it.
-            hist[index].head->next_hist->prev_hist = nullptr;
-            hist[index].head = hist[index].head->next_hist;
-            return;
+            return size / (_SMALL_BLOCK / _SL_COUNT);
         }
-        else if (to_remove == hist[index].tail)
+
+        int msb = 63 - __builtin_clzl(size);
+        int fl = msb - _FL_SHIFT + 1;
+        if(fl >= _FL_COUNT)
         {
-            hist[index].tail->prev_hist->next_hist = nullptr;
-            hist[index].tail = hist[index].tail->prev_hist;
-            return;
+            return _HIST_SIZE - 1;
         }
-
-        // This is not the only member in the list, but it is nor the first or the last. Remove it.
-        to_remove->prev_hist->next_hist = to_remove->next_hist;
-        to_remove->next_hist->prev_hist = to_remove->prev_hist;
-        return;
+        int sl = (size >> (msb - _SL_LOG)) - _SL_COUNT; // The _SL_LOG bits below the most significant one.
+        return fl * _SL_COUNT + sl;
     }
-    // $$$$$$$$$$ Historgram Functions $$$$$$$$$$ //
 
-    // ********** Mmap List Methods ********** //
-    void mmapInsert(_MallocMetaData* to_insert)
+    // Return the index of the first non empty hist list at or after from, or -1 if there is none.
+    // Takes constant time: one find-first-set in each level of the bitmap.
+    int histNextNonEmpty(int from)
     {
-        if (!to_insert || !IS_MMAPPED(to_insert->size))
+        if(from >= _HIST_SIZE)
         {
-            return;
+            return -1;
         }
-        if(mmap_head == nullptr) // This is the first mmapped region, add it.
+
+        int fl = from / _SL_COUNT;
+        uint32_t sl_map = sl_bitmap[fl] & (~0U << (from % _SL_COUNT));
+        if(sl_map == 0)
         {
-            mmap_head = to_insert;
-            to_insert->next = nullptr;
-            to_insert->prev = nullptr;
-            return;
+            uint32_t fl_map = fl_bitmap & (~0U << (fl + 1));
+            if(fl_map == 0)
+            {
+                return -1;
+            }
+            fl = __builtin_ctz(fl_map);
+            sl_map = sl_bitmap[fl];
         }
-        // otherwise, we will insert it in the head of the list.
-        to_insert->next = mmap_head;
-        to_insert->prev = nullptr;
-        mmap_head->prev = to_insert;
-        mmap_head = to_insert;
-        return;
+        return fl * _SL_COUNT + __builtin_ctz(sl_map);
     }
 
-    void mmapRemove(_MallocMetaData* to_remove)
+    // Return the tree links of a free heap block, which are kept in its payload.
+    inline _HistNode* histNode(_MallocMetaData* block)
+    {
+        return reinterpret_cast<_HistNode*>(getPayload(block));
+    }
+
+    // Return the highest size bit that may differ between two blocks of the hist list at index.
+    // The trie of the list branches on the size bits from this one down.
+    int histTreeBit(int index)
     {
-        if(to_remove == mmap_head && to_remove->next == nullptr)
+        if(index == _HIST_SIZE - 1)
         {
-            // This is both the first and last member of the list.
-            mmap_head = nullptr; // Empty the list.
-            return;
+            return 62; // The last list also holds every larger size.
         }
-        else if (to_remove == mmap_head)
+        int fl = index / _SL_COUNT;
+        if(fl == 0)
         {
-            // This is the first but not last member of the list.
-            to_remove->next->prev = nullptr;
-            mmap_head = to_remove->next;
-            return;
+            return 2; // The linear lists hold a single size (a multiple of 8), so they never branch.
         }
-        // This is not the first member of the list.
-        to_remove->prev->next = to_remove->next;
-        if(to_remove->next != nullptr) // It's not the last member of the list.
+        return (fl + _FL_SHIFT - 1) - _SL_LOG - 1; // The bits below the most significant bit and the _SL_LOG bits after it.
+    }
+
+    // Return the smallest block of the trie rooted at root. (The smallest size is always on the leftmost path)
+    _MallocMetaData* histTreeMin(_MallocMetaData* root)
+    {
+        _MallocMetaData* min = root;
+        for(_MallocMetaData* node = root; node; node = histNode(node)->child[0]? histNode(node)->child[0] : histNode(node)->child[1])
         {
-            to_remove->next->prev = to_remove->prev;
+            if(node->size < min->size)
+            {
+                min = node;
+            }
         }
-        return;
+        return min;
     }
-    // $$$$$$$$$$ Mmap List Methods $$$$$$$$$$ //
-
 
-    // ********** General Purpose ********** //
-    /**
-     * Check if the block uses a lot less data than the total payload size and:
-     * If it is, split it, add the new free block to the hist, and return the address of the splitted FREE metadata struct.
-     * Otherwise return NULL.
-     * - If split was successful and block was the wilderness, update the wilderness to be the splitted new block.
-     */ 
-    _MallocMetaData* split(_MallocMetaData* block, size_t in_use)
+    // Return the largest block of the trie rooted at root. (The largest size is always on the rightmost path)
+    _MallocMetaData* histTreeMax(_MallocMetaData* root)
     {
-        // Check if the leftover size is big enough for a new block of at least _MIN_SPLIT bytes + metadata size bytes:
-        if (block->size - in_use >= _MIN_SPLIT + _METADATA_SIZE) 
+        _MallocMetaData* max = root;
+        for(_MallocMetaData* node = root; node; node = histNode(node)->child[1]? histNode(node)->child[1] : histNode(node)->child[0])
         {
-            void* split_point = reinterpret_cast<void*>(reinterpret_cast<char*>(block) + in_use + _METADATA_SIZE);
-            setMetaData(reinterpret_cast<_MallocMetaData*>(split_point), block->size-in_use-_METADATA_SIZE, true, block->next, block);
-            
-            if(reinterpret_cast<_MallocMetaData*>(split_point)->next)
+            if(node->size > max->size)
             {
-                reinterpret_cast<_MallocMetaData*>(split_point)->next->prev = reinterpret_cast<_MallocMetaData*>(split_point);
+                max = node;
             }
-
-            block->size = in_use;
-            block->next = reinterpret_cast<_MallocMetaData*>(split_point);
-
-            // Insert the new freed block to the hist:
-            histInsert(reinterpret_cast<_MallocMetaData*>(split_point));
-            if(block == wilderness) wilderness = reinterpret_cast<_MallocMetaData*>(split_point);
-            return reinterpret_cast<_MallocMetaData*>(split_point);
         }
-
-        // Split was not necessary:
-        return nullptr;
+        return max;
     }
 
-    /**
-     * Given a free block as an argument, check if able to merge it to other free blocks
-     * surrounding it, and merge if possible.
-     * Return true if was able to merge and update new_block to point to the new metadata.
-     * Otherwise, return false.
-     * If new_block is null, only return true if the merge is possible in any way or false otherwise.
-     */
-    bool mergeFree(_MallocMetaData* block, _MallocMetaData** new_block)
+    // Return the smallest size that the hist list at index holds.
+    static size_t histMinSize(int index)
     {
-        if(!block || !block->is_free)
+        int fl = index / _SL_COUNT;
+        int sl = index % _SL_COUNT;
+        if(fl == 0)
         {
-            return false;
+            return sl * (_SMALL_BLOCK / _SL_COUNT);
         }
-        if(block->prev)
+        int msb = fl + _FL_SHIFT - 1;
+        return size_t(_SL_COUNT + sl) << (msb - _SL_LOG);
+    }
+
+    // Return the smallest block of the hist list at index that can contain bytes, or nullptr if there is none.
+    // Takes time bounded by the depth of the trie, which is the number of size bits that differ within the list.
+    _MallocMetaData* histBestFit(int index, size_t bytes)
+    {
+        _MallocMetaData* best = nullptr;
+        size_t best_rest = (size_t)-1;
+        _MallocMetaData* node = hist[index].root;
+        _MallocMetaData* larger = nullptr; // The root of the last subtree that holds only sizes above bytes.
+        size_t bits = bytes << (63 - histTreeBit(index));
+
+        // Follow the path of bytes down the trie, checking every node on the way:
+        while(node)
         {
-            if(block->prev->is_free)
+            if(node->size >= bytes && node->size - bytes < best_rest)
             {
-                if(block->next)
+                best = node;
+                best_rest = node->size - bytes;
+                if(best_rest == 0)
                 {
-                    if(block->next->is_free)
-                    {
-                        if(new_block) 
-                        {
-                            num_meta_data_bytes -= (2 * _METADATA_SIZE);
-                            num_allocated_bytes += (2 * _METADATA_SIZE);
-                            num_free_blocks -= 2;
-                            num_free_bytes += (2 * _METADATA_SIZE);
-                            num_allocated_blocks -= 2;
-                            histRemove(block);
-                            histRemove(block->prev);
-                            histRemove(block->next);
-                            _mergeToSurrounding(block, new_block, true);
-                        }
-                        return true;
-                    }
-                    else
-                    {
-                        if(new_block) 
-                        {
-                            num_meta_data_bytes -= _METADATA_SIZE;
-                            num_free_blocks--;
-                            num_free_bytes += _METADATA_SIZE;
-                            num_allocated_bytes += _METADATA_SIZE;
-                            num_allocated_blocks--;
-                            histRemove(block);
-                            histRemove(block->prev);
-                            _mergeToPrev(block, new_block, true);
-                        }
-                        return true;
-                    }
+                    return best;
                 }
-                if(new_block)
-                {
-                    num_meta_data_bytes -= _METADATA_SIZE;
-                    num_allocated_bytes += _METADATA_SIZE;
-                    num_free_blocks--;
-                    num_free_bytes += _METADATA_SIZE;
-                    num_allocated_blocks--;
-                    histRemove(block);
-                    histRemove(block->prev);
-                    _mergeToPrev(block, new_block, true);
-                }
-                return true;
             }
+            _MallocMetaData* right = histNode(node)->child[1];
+            node = histNode(node)->child[(bits >> 63) & 1];
+            if(right != nullptr && right != node)
+            {
+                larger = right;
+            }
+            bits <<= 1;
         }
-        if(block->next)
+
+        // Any block of the larger subtree can contain bytes, so the best of it is its smallest:
+        if(larger)
         {
-            if(block->next->is_free)
+            _MallocMetaData* min = histTreeMin(larger);
+            if(min->size - bytes < best_rest)
             {
-                if(new_block) 
-                {
-                    num_meta_data_bytes -= _METADATA_SIZE;
-                    num_allocated_bytes += _METADATA_SIZE;
-                    num_free_blocks--;
-                    num_free_bytes += _METADATA_SIZE;
-                    num_allocated_blocks--;
-                    histRemove(block);
-                    histRemove(block->next);
-                    _mergeToNext(block, new_block, true);
-                }
-                return true;
+                best = min;
             }
         }
-
-        // If we get here, no merge was successful.
-        return false;
+        return best;
     }
 
-    /**
-     * Assumption: block, its prev, and its next - all exist.
-     * Will not change the data that was in the original input address of block and its surroundings.
-     * Merge all of them to one big block and set new_block to the metadata address of the merged block.
-     */
-    _MallocMetaData* _mergeToSurrounding(_MallocMetaData* block, _MallocMetaData** new_block, bool to_free)
+    // Insert a free block into its hist list in time bounded by the depth of the trie of the list.
+    // A block whose size is already in the trie is chained to that node instead of getting a node of its own.
+    void histInsert(_MallocMetaData* to_insert)
     {
-        assert(block); assert(block->next); assert(block->prev); assert(new_block);
-        return _mergeToNext(_mergeToPrev(block, new_block, false), new_block, to_free);
-    }
+        int index = histIndex(to_insert->size);
+        assert(index < _HIST_SIZE);
 
-    /**
-     * Assumption: block and its prev exist.
-     * Will not change the data that was in the original input address of block and its surroundings.
-     * Merge them to one big block and set new_block to the metadata address of the merged block.
-     */
-    _MallocMetaData* _mergeToPrev(_MallocMetaData* block, _MallocMetaData** new_block, bool to_free)
-    {
-        assert(block); assert(block->prev); assert(new_block);
+        hist[index].size++; // Someone will definitely get in this list one way or another.
+        sl_bitmap[index / _SL_COUNT] |= (1U << (index % _SL_COUNT));
+        fl_bitmap |= (1U << (index / _SL_COUNT));
 
-        if(block == wilderness)
+        _HistNode* new_node = histNode(to_insert);
+        new_node->child[0] = nullptr;
+        new_node->child[1] = nullptr;
+        new_node->parent = nullptr;
+        new_node->in_tree = true;
+        new_node->next_hist = to_insert;
+        new_node->prev_hist = to_insert;
+
+        if (hist[index].root == nullptr) // The list is empty at the corresponding index for size
         {
-            wilderness = block->prev;
+            hist[index].root = to_insert;
+            return;
         }
-        setMetaData(block->prev, block->prev->size + block->size + _METADATA_SIZE, to_free, block->next, block->prev->prev);
-        if(block->prev->next) // NOTE: This is the updated next block for the merged block - if it exists:
+
+        _MallocMetaData* node = hist[index].root;
+        size_t bits = to_insert->size << (63 - histTreeBit(index));
+        while(true)
         {
-            block->prev->next->prev = block->prev;
-        }
+            if(node->size == to_insert->size)
+            {
+                // Chain the new block after the node of its size:
+                new_node->in_tree = false;
+                _HistNode* chained_node = histNode(node);
+                new_node->next_hist = chained_node->next_hist;
+                new_node->prev_hist = node;
+                histNode(chained_node->next_hist)->prev_hist = to_insert;
+                chained_node->next_hist = to_insert;
+                return;
+            }
 
-        if(to_free) histInsert(block->prev);
-        *new_block = block->prev;
-        return block->prev;
+            _MallocMetaData** child = &histNode(node)->child[(bits >> 63) & 1];
+            if(*child == nullptr)
+            {
+                *child = to_insert;
+                new_node->parent = node;
+                return;
+            }
+            node = *child;
+            bits <<= 1;
+        }
     }
 
-    /**
-     * Assumption: block and its next exist.
-     * Will not change the data that was in the original input address of block and its surroundings.
-     * Merge them to one big block and set new_block to the metadata address of the merged block.
-     */
-    _MallocMetaData* _mergeToNext(_MallocMetaData* block, _MallocMetaData** new_block, bool to_free)
+    void histRemove(_MallocMetaData* to_remove)
     {
-        assert(block); assert(block->next); assert(new_block);
-        
-        if(block->next == wilderness) wilderness = block;
-        setMetaData(block, block->size + block->next->size + _METADATA_SIZE, to_free, block->next->next, block->prev);
-        if(block->next) // NOTE: This is the updated next block - if it exists:
+        if (!to_remove)
         {
-            block->next->prev = block;
+            return;
         }
+        int index = histIndex(to_remove->size);
+        assert(index < _HIST_SIZE);
 
-        if(to_free) histInsert(block);
-        *new_block = block;
-        return block;
-    }
+        // The block is about to be used or resized, so its released pages will be faulted back in:
+        if(to_remove->flags & _BLOCK_RELEASED)
+        {
+            to_remove->flags &= ~_BLOCK_RELEASED;
+            num_released_bytes -= heapReleasable(to_remove, nullptr);
+        }
 
-    _MallocMetaData* _extendWilderness(size_t new_size)
-    {
-        size_t wilderness_prev_size = wilderness->size;
-        bool was_free = wilderness->is_free;
-        if(new_size > wilderness->size) // Check if needed to enlarge or can contain.
+        hist[index].size--; // Remove will always be successful.
+        if(hist[index].size == 0)
         {
-            // Need to extend. (Should always enter this if case because free_block == nullptr)
-            intptr_t to_extend = new_size - wilderness_prev_size;
-            void* prev_brk = sbrk(to_extend);
-            if(prev_brk == (void*)-1)
+            sl_bitmap[index / _SL_COUNT] &= ~(1U << (index % _SL_COUNT));
+            if(sl_bitmap[index / _SL_COUNT] == 0)
             {
-                return NULL;
+                fl_bitmap &= ~(1U << (index / _SL_COUNT));
             }
-            num_allocated_bytes += to_extend;
         }
-        
-        if(was_free) histRemove(wilderness);
-        setMetaData(wilderness, new_size, false, nullptr, wilderness->prev);
-        _MallocMetaData* res = split(wilderness, new_size);
-        
-        if(was_free)
+
+        _HistNode* node = histNode(to_remove);
+        _MallocMetaData* replacement = nullptr;
+        if(node->next_hist != to_remove)
         {
-            if(res) // If split was successful: (Should never happen theoretically)
+            // There are other blocks of the same size: unchain the block, and let the next one take its place in the trie.
+            histNode(node->prev_hist)->next_hist = node->next_hist;
+            histNode(node->next_hist)->prev_hist = node->prev_hist;
+            if(!node->in_tree)
             {
-                // Update statistics:
-                num_free_bytes -= (wilderness->size + _METADATA_SIZE);
-                num_meta_data_bytes += _METADATA_SIZE;
-                return wilderness;
+                return;
             }
-
-            // No split was needed:
-            // Update statistics:
-            num_free_blocks--;
-            num_free_bytes -= wilderness_prev_size; // The total size was not counted before in the statistic
-            return wilderness;
+            replacement = node->next_hist;
         }
-        else // Was not free
+        else
         {
-            if(res) // If split was successful: (Should never happen theoretically)
+            // The block is the only one of its size: detach a leaf of its subtree to take its place (if it has one).
+            _MallocMetaData** link = node->child[1]? &node->child[1] : &node->child[0];
+            replacement = *link;
+            if(replacement)
             {
-                // Update statistics:
-                num_free_blocks++;
-                num_allocated_blocks++;
-                num_free_bytes += res->size;
-                num_meta_data_bytes += _METADATA_SIZE;
-                num_allocated_bytes -= _METADATA_SIZE;
-                return wilderness;
+                while(true)
+                {
+                    _HistNode* replacement_node = histNode(replacement);
+                    _MallocMetaData** next_link = replacement_node->child[1]? &replacement_node->child[1] : &replacement_node->child[0];
+                    if(*next_link == nullptr)
+                    {
+                        break;
+                    }
+                    link = next_link;
+                    replacement = *link;
+                }
+                *link = nullptr;
             }
+        }
 
-            // No split was needed:            
-            return wilderness;
+        // Put the replacement in the place of the removed block:
+        if(replacement)
+        {
+            _HistNode* replacement_node = histNode(replacement);
+            replacement_node->in_tree = true;
+            replacement_node->parent = node->parent;
+            for(int i = 0; i < 2; i++)
+            {
+                replacement_node->child[i] = node->child[i];
+                if(node->child[i])
+                {
+                    histNode(node->child[i])->parent = replacement;
+                }
+            }
         }
-    }
-    // $$$$$$$$$$ General Purpose $$$$$$$$$$ //
 
-public:
-    static _AllocList& getInstance()    // make _AllocList singleton
-    {
-        static _AllocList instance; // Guaranteed to be destroyed.
-        // Instantiated on first use.
-        return instance;
+        if(node->parent == nullptr)
+        {
+            hist[index].root = replacement;
+        }
+        else
+        {
+            _HistNode* parent_node = histNode(node->parent);
+            parent_node->child[parent_node->child[0] == to_remove? 0 : 1] = replacement;
+        }
     }
-    ~_AllocList() = default;
+    // $$$$$$$$$$ Historgram Functions $$$$$$$$$$ //
 
-    // ********** Main Funcs ********** //
-    void* smalloc(size_t size)
+    // ********** Segment Methods ********** //
+    /**
+     * Move the break of the current segment by increment bytes, like sbrk(), and return the old break.
+     * The pages are committed (made accessible) as the break moves up, and decommitted as it moves back.
+     * If the segment has no room for increment bytes, a new one is reserved and its start is returned instead,
+     * so the heap continues in a new segment. Return (void*)-1 if the memory could not be reserved or committed.
+     * A segment that is backed by huge pages is aligned to them, and committed in whole huge pages.
+     */
+    void* segmentSbrk(intptr_t increment)
     {
-        if(size == 0 || size > MAX_ALLOC_SIZE)
+        if(segment_break == nullptr || segment_break + increment > segment_end)
         {
-            return NULL;
+            // heapSbrk() may need up to the old reserve more in a new segment, to fit its block and fence:
+            size_t alignment = huge_pages? _HUGE_PAGE_SIZE : _RUN_SIZE;
+            size_t length = (increment + heap_reserve + 2 * alignment - 1) & ~(alignment - 1);
+            if(length < _SEGMENT_SIZE)
+            {
+                length = _SEGMENT_SIZE;
+            }
+            char* segment = reinterpret_cast<char*>(mapAligned(length, alignment, PROT_NONE, MAP_NORESERVE));
+            if(segment == nullptr)
+            {
+                return (void*)-1;
+            }
+            if(!pagemapSet(segment, length, _CHUNK_ARENA + id))
+            {
+                pagemapSet(segment, length, _CHUNK_NONE);
+                munmap(segment, length);
+                return (void*)-1;
+            }
+            segment_break = segment;
+            segment_committed = segment;
+            segment_end = segment + length;
+            heap_clean = segment;
+            segment_huge = huge_pages && madvise(segment, length, MADV_HUGEPAGE) == 0;
         }
 
-        size = ROUND_UP(size);
-
-        if(!IS_MMAPPED(size))
+        char* old_break = segment_break;
+        uintptr_t granule = segment_huge? _HUGE_PAGE_SIZE : _PAGE_SIZE;
+        char* committed = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(old_break + increment) + granule - 1) & ~(granule - 1));
+        if(committed > segment_committed)
         {
-            if(head == nullptr) // This is the first allocation made so far
+            if(mprotect(segment_committed, committed - segment_committed, PROT_READ | PROT_WRITE) != 0)
             {
-                void* prev_brk = sbrk(size + _METADATA_SIZE);
-                if(prev_brk == (void*)-1)
-                {
-                    return NULL;
-                }
-
-                head = reinterpret_cast<_MallocMetaData*>(prev_brk);
-                setMetaData(head, size, false, nullptr, nullptr);
-                wilderness = head;
-
-                // Update statistics:
-                num_allocated_blocks++;
-                num_allocated_bytes += size;
-                num_meta_data_bytes += _METADATA_SIZE;
-
-                return getPayload(head);
+                return (void*)-1;
             }
+        }
+        else if(committed < segment_committed)
+        {
+            madvise(committed, segment_committed - committed, MADV_DONTNEED);
+            mprotect(committed, segment_committed - committed, PROT_NONE);
+        }
+        if(segment_huge)
+        {
+            num_huge_bytes += committed - segment_committed;
+        }
+        segment_committed = committed;
+        segment_break = old_break + increment;
+        return old_break;
+    }
+    // $$$$$$$$$$ Segment Methods $$$$$$$$$$ //
 
-            // Otherwise, this wasn't the first allocation, so we try to find a free block.
-            _MallocMetaData* free_block = getFreeBlock(size);
-            if(free_block == nullptr) // If there is no free block that can contain size bytes
-            {
-                if(wilderness->is_free) // If the last block in the heap is free we can simply enlarge it:
-                {
-                    return getPayload(_extendWilderness(size));
-                }
-
-                void* prev_brk = sbrk(size + _METADATA_SIZE); // Allocate space at the top of the heap
-                if(prev_brk == (void*)-1)
-                {
-                    return NULL;
-                }
+    // ********** Heap Segment Methods ********** //
+    // Move the fence bytes up into the reserve (that is right after it) and return its old address, which becomes
+    // the metadata slot of the new memory. It keeps the _BLOCK_PREV_FREE flag of the fence.
+    void* heapMoveFence(size_t bytes, size_t* got)
+    {
+        assert(bytes <= heap_reserve);
+        _MallocMetaData* new_fence = reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(fence) + bytes);
+        new_fence->size = 0;
+        new_fence->flags = _BLOCK_FENCE;
+        heap_clean = std::max(heap_clean, reinterpret_cast<char*>(new_fence) + _METADATA_SIZE);
+        fence->flags &= _BLOCK_PREV_FREE;
+        void* start = fence;
+        fence = new_fence;
+        heap_reserve -= bytes;
+        *got = bytes;
+        return start;
+    }
 
-                // Update the new wilderness block:
-                _MallocMetaData* last_wilderness = wilderness;
-                last_wilderness->next = reinterpret_cast<_MallocMetaData*>(prev_brk);
-                wilderness = reinterpret_cast<_MallocMetaData*>(prev_brk);
+    /**
+     * Grow the heap by at least bytes, keeping a fence right after the new memory.
+     * Return the address where the new memory starts and set got to its size, or return nullptr if segmentSbrk() failed.
+     * - The bytes are carved from the reserve (the memory between the fence and the break) when possible. Otherwise
+     *   the break is moved by a chunk, that doubles each time up to heap_chunk_max, and the rest is kept as the reserve.
+     * - If the current segment had room for the chunk, the new memory starts at the old fence (which is moved
+     *   to its end), so it continues the last block of the heap.
+     * - Otherwise it is a new segment, that is linked from the old fence and can hold a block of _MIN_PAYLOAD bytes.
+     *   The reserve of the old segment is added to it as a free block.
+     * The metadata slot at the returned address keeps the right _BLOCK_PREV_FREE flag.
+     */
+    void* heapSbrk(size_t bytes, size_t* got)
+    {
+        if(fence && bytes <= heap_reserve)
+        {
+            return heapMoveFence(bytes, got);
+        }
 
-                setMetaData(wilderness, size, false, nullptr, last_wilderness);
+        size_t chunk = bytes > heap_chunk? bytes : heap_chunk;
+        heap_chunk = 2 * heap_chunk > heap_chunk_max? heap_chunk_max : 2 * heap_chunk;
 
-                // Update statistics:
-                num_allocated_blocks++;
-                num_allocated_bytes += size;
-                num_meta_data_bytes += _METADATA_SIZE;
-                
-                return getPayload(reinterpret_cast<_MallocMetaData*>(prev_brk));
-            }
+        char* heap_end = fence? reinterpret_cast<char*>(fence) + _METADATA_SIZE + heap_reserve : nullptr;
+        size_t requested = fence? chunk - heap_reserve : chunk + _METADATA_SIZE; // A first segment also needs room for its fence.
+        void* prev_brk = segmentSbrk(requested);
+        if(prev_brk == (void*)-1)
+        {
+            return nullptr;
+        }
 
-            // If there exists a free block that can contain size bytes:
-            free_block->is_free = false;
-            histRemove(free_block);
-            _MallocMetaData* res = split(free_block, size);
+        char* start = reinterpret_cast<char*>(prev_brk);
+        if(start == heap_end)
+        {
+            heap_reserve += requested;
+            return heapMoveFence(bytes, got);
+        }
 
-            // Update statistics:
-            if(!res)
-            {
-                // If split failed, then we have one less free block.
-                num_free_blocks--;
-                num_free_bytes -= free_block->size;
-            }
-            else
+        // This is a new segment:
+        if(fence)
+        {
+            if(heap_reserve >= _METADATA_SIZE + _MIN_PAYLOAD)
             {
-                // If split was successful, we need to count _METADATA_SIZE less bytes in the total free bytes statistic.
-                num_free_bytes -= (size + _METADATA_SIZE);
-                num_allocated_bytes -= _METADATA_SIZE;
-                num_meta_data_bytes += _METADATA_SIZE;
-                num_allocated_blocks++;
+                size_t reserve_size;
+                void* reserve_start = heapMoveFence(heap_reserve, &reserve_size);
+                heapAddFreeBlock(reserve_start, reserve_size);
             }
-            return getPayload(free_block);
+            heap_reserve = 0; // (Anything smaller is lost)
         }
-        else
+
+        size_t segment_size = bytes < _METADATA_SIZE + _MIN_PAYLOAD? _METADATA_SIZE + _MIN_PAYLOAD : bytes;
+        if(segment_size + _METADATA_SIZE > requested)
         {
-            void* ptr = mmap(NULL, size + _METADATA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-            if(ptr == MAP_FAILED)
+            void* more = segmentSbrk(segment_size + _METADATA_SIZE - requested);
+            if(more != start + requested)
             {
+                // The memory could not be committed (or did not fit in the new segment), it can not be used.
                 return nullptr;
             }
-            setMetaData(reinterpret_cast<_MallocMetaData*>(ptr), size, false, nullptr, nullptr);
-            mmapInsert(reinterpret_cast<_MallocMetaData*>(ptr));
+            requested = segment_size + _METADATA_SIZE;
+        }
 
-            // Update statistics:
-            num_allocated_blocks++;
-            num_allocated_bytes += size;
-            num_meta_data_bytes += _METADATA_SIZE;
-            return getPayload(reinterpret_cast<_MallocMetaData*>(ptr));
+        reinterpret_cast<_MallocMetaData*>(start)->flags = 0;
+        _MallocMetaData* new_fence = reinterpret_cast<_MallocMetaData*>(start + segment_size);
+        new_fence->size = 0;
+        new_fence->flags = _BLOCK_FENCE;
+        heap_clean = std::max(heap_clean, reinterpret_cast<char*>(new_fence) + _METADATA_SIZE);
+        if(fence)
+        {
+            fence->size = reinterpret_cast<size_t>(start);
+        }
+        else
+        {
+            head = reinterpret_cast<_MallocMetaData*>(start);
         }
+        fence = new_fence;
+        heap_reserve = requested - segment_size - _METADATA_SIZE;
+
+        // Update statistics:
+        num_meta_data_bytes += _METADATA_SIZE;
+
+        *got = segment_size;
+        return start;
     }
-    
-    void* scalloc(size_t num, size_t size)
+
+    // Turn the memory of a new heap segment (or the reserve of the old one) into a free block, which becomes the
+    // wilderness. The reserve follows the old wilderness, and is merged with it if it is free.
+    void heapAddFreeBlock(void* start, size_t bytes)
     {
-        void* p = smalloc(num * size);
-        if(p == nullptr)
+        _MallocMetaData* block = reinterpret_cast<_MallocMetaData*>(start);
+        block->size = bytes - _METADATA_SIZE;
+        setFree(block, true);
+        histInsert(block);
+        wilderness = block;
+
+        // Update statistics:
+        num_allocated_blocks++;
+        num_allocated_bytes += block->size;
+        num_meta_data_bytes += _METADATA_SIZE;
+        num_free_blocks++;
+        num_free_bytes += block->size;
+
+        mergeFree(block, &block); // Merge updates the statistics assuming that block is free.
+    }
+
+    // Return the size of the whole pages in the payload of a free block that can be released, and set start to the first one.
+    // The hist node at the start of the payload and the footer at its end are kept resident.
+    size_t heapReleasable(_MallocMetaData* block, char** start)
+    {
+        uintptr_t payload = reinterpret_cast<uintptr_t>(getPayload(block));
+        uintptr_t first = (payload + sizeof(_HistNode) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
+        uintptr_t last = (payload + block->size - sizeof(size_t)) & ~(_PAGE_SIZE - 1);
+        if(start)
         {
-            return nullptr;
+            *start = reinterpret_cast<char*>(first);
         }
-        if(!IS_MMAPPED(size)) memset(p, 0, ROUND_UP(num * size));
-        return p;
+        return last > first? last - first : 0;
     }
 
-    void sfree(void* p)
+    /**
+     * Give the inner pages of a large free block back to the OS with madvise(), while keeping its metadata (header,
+     * hist node and footer) in place. The pages read as zeros when they are used again.
+     * The wilderness is left to heapTrim(), since it is the first to be reused when the heap grows.
+     */
+    void heapRelease(_MallocMetaData* block)
     {
-        _MallocMetaData* ptr = getMetaData(p);
-        if(ptr == nullptr || ptr->is_free == true)
+        if(block == wilderness || !isFree(block) || (block->flags & _BLOCK_RELEASED) || block->size < _RELEASE_THRESHOLD)
         {
             return;
         }
-        if(!IS_MMAPPED(ptr->size))
+
+        char* start;
+        size_t bytes = heapReleasable(block, &start);
+        if(bytes == 0 || madvise(start, bytes, MADV_DONTNEED) != 0)
         {
-            ptr->is_free = true;
+            return;
+        }
+        block->flags |= _BLOCK_RELEASED;
 
-            // Update statistics (merge will update again if there are adjecent blocks that are also free)
-            num_free_blocks++;
-            num_free_bytes += ptr->size;
+        // Update statistics:
+        num_released_bytes += bytes;
+    }
 
-            _MallocMetaData* new_block;
-            histInsert(ptr);
-            bool res = mergeFree(ptr, &new_block); // Merge updates the statistics assuming that block is free.
+    /**
+     * Give the top of a free wilderness (and the reserve after it) back to the OS by moving the break of the segment
+     * back, once the wilderness is larger than trim_threshold.
+     * top_pad bytes are kept in the wilderness, so the heap does not shrink and grow again on every sfree/smalloc
+     * around the same size: after a trim, it takes more than top_pad bytes to grow the heap, and another
+     * trim_threshold - top_pad free bytes to trim it.
+     */
+    void heapTrim()
+    {
+        if(!wilderness || !isFree(wilderness) || wilderness->size < trim_threshold || wilderness->size <= top_pad)
+        {
             return;
         }
-        else
-        {
-            // Update statistics:
-            num_allocated_blocks--;
-            num_allocated_bytes -= ptr->size;
-            num_meta_data_bytes -= _METADATA_SIZE;
 
-            // Unmap region:
-            mmapRemove(ptr);
-            munmap(p, ptr->size + _METADATA_SIZE);
+        size_t block_trim = (wilderness->size - top_pad) & ~(_PAGE_SIZE - 1);
+        size_t to_trim = block_trim + heap_reserve;
+        char* heap_end = reinterpret_cast<char*>(fence) + _METADATA_SIZE + heap_reserve;
+        if(to_trim == 0 || segment_break != heap_end) // The wilderness must be at the top of the current segment.
+        {
+            return;
         }
+        segmentSbrk(-static_cast<intptr_t>(to_trim));
+        heap_clean = std::min(heap_clean, segment_committed); // The decommitted pages are zeroed again.
+
+        histRemove(wilderness);
+        wilderness->size -= block_trim;
+        fence = getNext(wilderness);
+        fence->size = 0;
+        fence->flags = _BLOCK_FENCE;
+        setFree(wilderness, true);
+        histInsert(wilderness);
+        heap_reserve = 0;
+        heap_chunk = heap_chunk_min; // The heap shrinks, so it starts growing slowly again.
+
+        // Update statistics:
+        num_allocated_bytes -= block_trim;
+        num_free_bytes -= block_trim;
+        num_trimmed_bytes += to_trim;
     }
+    // $$$$$$$$$$ Heap Segment Methods $$$$$$$$$$ //
 
-    void* srealloc(void* oldp, size_t size)
+
+
+    // ********** General Purpose ********** //
+    /**
+     * Check if the block uses a lot less data than the total payload size and:
+     * If it is, split it, add the new free block to the hist, and return the address of the splitted FREE metadata struct.
+     * Otherwise return NULL.
+     * - The block must be in use.
+     * - If split was successful and block was the wilderness, update the wilderness to be the splitted new block.
+     */ 
+    _MallocMetaData* split(_MallocMetaData* block, size_t in_use)
     {
-        if(size == 0 || size > MAX_ALLOC_SIZE)
+        assert(!isFree(block));
+
+        // Check if the leftover size is big enough for a new block of at least _MIN_SPLIT bytes + metadata size bytes:
+        if (block->size - in_use >= _MIN_SPLIT + _METADATA_SIZE) 
         {
-            return NULL;
+            _MallocMetaData* split_block = reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(block) + in_use + _METADATA_SIZE);
+            split_block->size = block->size - in_use - _METADATA_SIZE;
+            split_block->flags = 0; // The block before it is in use.
+            block->size = in_use;
+            setFree(split_block, true);
+
+            // Insert the new freed block to the hist:
+            histInsert(split_block);
+            if(block == wilderness) wilderness = split_block;
+            _COUNT_PATH(_PATH_SPLIT);
+            return split_block;
         }
 
-        size = ROUND_UP(size);
+        // Split was not necessary:
+        return nullptr;
+    }
 
-        if(oldp == NULL)
+    /**
+     * Count the free block that split() cut off the end of a block in use, and merge it with the block after it if that
+     * one is free. (split() leaves that to the caller: a block cut from a free block never has a free block after it,
+     * but one cut from a block in use may)
+     */
+    void freeSplitRest(_MallocMetaData* rest)
+    {
+        // Update statistics:
+        num_free_blocks++;
+        num_free_bytes += rest->size;
+        num_allocated_blocks++;
+        num_meta_data_bytes += _METADATA_SIZE;
+        num_allocated_bytes -= _METADATA_SIZE;
+
+        mergeFree(rest, &rest);
+        heapRelease(rest);
+    }
+
+    /**
+     * Split the first front bytes of a block off as a free block (of front - _METADATA_SIZE bytes), add it to the hist,
+     * and return the metadata of the rest of the block, which starts front bytes later.
+     * - The block must be in use, and front must leave room for a free block.
+     * - If block was the wilderness, the rest of it becomes the wilderness.
+     */
+    _MallocMetaData* splitFront(_MallocMetaData* block, size_t front)
+    {
+        assert(!isFree(block));
+        assert(front >= _METADATA_SIZE + _MIN_PAYLOAD && front < block->size);
+
+        _MallocMetaData* rest = reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(block) + front);
+        rest->size = block->size - front;
+        rest->flags = 0;
+        block->size = front - _METADATA_SIZE;
+        setFree(block, true);
+        histInsert(block);
+        if(block == wilderness) wilderness = rest;
+        return rest;
+    }
+
+    /**
+     * Given a free block as an argument, check if able to merge it to other free blocks
+     * surrounding it, and merge if possible.
+     * Return true if was able to merge and update new_block to point to the new metadata.
+     * Otherwise, return false.
+     * If new_block is null, only return true if the merge is possible in any way or false otherwise.
+     */
+    bool mergeFree(_MallocMetaData* block, _MallocMetaData** new_block)
+    {
+        if(!block || !isFree(block))
         {
-            return smalloc(size);
+            return false;
         }
-        _MallocMetaData* oldmeta = reinterpret_cast<_MallocMetaData*>(getMetaData(oldp));
-        size_t old_size = oldmeta->size;
-
-        if(!IS_MMAPPED(old_size))
+        _MallocMetaData* prev = getFreePrev(block);
+        _MallocMetaData* next = getNext(block); // The fence after the last block is never free.
+        if(prev)
         {
-            // A: Try to reuse the current block without any merging:
-            if(size <= oldmeta->size)
+            if(isFree(next))
             {
-                _MallocMetaData* new_block = split(oldmeta, size);
-                if(new_block)
+                if(new_block) 
                 {
-                    // If the split succeeded, update statistics:
-                    num_free_bytes += new_block->size;
-                    num_meta_data_bytes += _METADATA_SIZE;
-                    num_allocated_bytes -= _METADATA_SIZE;
-                    num_free_blocks++;
-                    num_allocated_blocks++;
+                    num_meta_data_bytes -= (2 * _METADATA_SIZE);
+                    num_allocated_bytes += (2 * _METADATA_SIZE);
+                    num_free_blocks -= 2;
+                    num_free_bytes += (2 * _METADATA_SIZE);
+                    num_allocated_blocks -= 2;
+                    histRemove(block);
+                    histRemove(prev);
+                    histRemove(next);
+                    _mergeToSurrounding(block, new_block, true);
                 }
-                return oldp;
+                return true;
             }
 
-            // B: Try to merge with the adjacent block with the LOWER address:
-            else if(oldmeta->prev && oldmeta->prev->is_free && (oldmeta->size + oldmeta->prev->size + _METADATA_SIZE >= size))
+            if(new_block) 
             {
-                // We can merge the left block with our block.
-                _MallocMetaData* new_block = nullptr;
-
-                // Update statistics:
                 num_meta_data_bytes -= _METADATA_SIZE;
-                num_allocated_bytes += _METADATA_SIZE;
-                num_free_bytes -= oldmeta->prev->size;
                 num_free_blocks--;
+                num_free_bytes += _METADATA_SIZE;
+                num_allocated_bytes += _METADATA_SIZE;
                 num_allocated_blocks--;
-                
-                histRemove(oldmeta->prev);
-                _mergeToPrev(oldmeta, &new_block, false);
-
-                // Copy the data to the new address:
-                memmove(getPayload(new_block), oldp, old_size);
+                histRemove(block);
+                histRemove(prev);
+                _mergeToPrev(block, new_block, true);
+            }
+            return true;
+        }
+        if(isFree(next))
+        {
+            if(new_block) 
+            {
+                num_meta_data_bytes -= _METADATA_SIZE;
+                num_allocated_bytes += _METADATA_SIZE;
+                num_free_blocks--;
+                num_free_bytes += _METADATA_SIZE;
+                num_allocated_blocks--;
+                histRemove(block);
+                histRemove(next);
+                _mergeToNext(block, new_block, true);
+            }
+            return true;
+        }
+
+        // If we get here, no merge was successful.
+        return false;
+    }
+
+    /**
+     * Assumption: block, its prev, and its next - are all free (except for block itself, that may be in use).
+     * Will not change the data that was in the original input address of block and its surroundings.
+     * Merge all of them to one big block and set new_block to the metadata address of the merged block.
+     */
+    _MallocMetaData* _mergeToSurrounding(_MallocMetaData* block, _MallocMetaData** new_block, bool to_free)
+    {
+        assert(block); assert(new_block);
+        return _mergeToNext(_mergeToPrev(block, new_block, false), new_block, to_free);
+    }
+
+    /**
+     * Assumption: the prev of block is free.
+     * Will not change the data that was in the original input address of block and its surroundings.
+     * Merge them to one big block and set new_block to the metadata address of the merged block.
+     */
+    _MallocMetaData* _mergeToPrev(_MallocMetaData* block, _MallocMetaData** new_block, bool to_free)
+    {
+        _MallocMetaData* prev = getFreePrev(block);
+        assert(block); assert(prev); assert(new_block);
+
+        if(block == wilderness)
+        {
+            wilderness = prev;
+        }
+        prev->size += block->size + _METADATA_SIZE;
+        setFree(prev, to_free);
+
+        if(to_free) histInsert(prev);
+        *new_block = prev;
+        return prev;
+    }
+
+    /**
+     * Assumption: the next of block is free.
+     * Will not change the data that was in the original input address of block and its surroundings.
+     * Merge them to one big block and set new_block to the metadata address of the merged block.
+     */
+    _MallocMetaData* _mergeToNext(_MallocMetaData* block, _MallocMetaData** new_block, bool to_free)
+    {
+        _MallocMetaData* next = getNext(block);
+        assert(block); assert(isFree(next)); assert(new_block);
+        
+        if(next == wilderness) wilderness = block;
+        block->size += next->size + _METADATA_SIZE;
+        setFree(block, to_free);
+
+        if(to_free) histInsert(block);
+        *new_block = block;
+        return block;
+    }
+
+    /**
+     * Enlarge the wilderness to new_size bytes by growing the heap and allocate it.
+     * Return nullptr if the heap could not grow, or if the new memory did not continue the heap (the segment was
+     * full, so it is in a new one). In the latter case the new memory was added as a free block and became the wilderness.
+     */
+    _MallocMetaData* _extendWilderness(size_t new_size)
+    {
+        _MallocMetaData* block = wilderness;
+        size_t wilderness_prev_size = block->size;
+        bool was_free = isFree(block);
+        if(new_size > block->size) // Check if needed to enlarge or can contain.
+        {
+            size_t got;
+            void* start = heapSbrk(new_size - wilderness_prev_size, &got);
+            if(!start)
+            {
+                return nullptr;
+            }
+            if(start != getNext(block))
+            {
+                heapAddFreeBlock(start, got);
+                return nullptr;
+            }
+            if(was_free) histRemove(block);
+            block->size += got;
+            num_allocated_bytes += got;
+        }
+        else if(was_free)
+        {
+            histRemove(block);
+        }
+
+        setFree(block, false);
+        _MallocMetaData* res = split(block, new_size);
+
+        // Update statistics:
+        if(was_free)
+        {
+            num_free_blocks--;
+            num_free_bytes -= wilderness_prev_size; // The added size was not counted before in the statistic
+        }
+        if(res) // If split was successful: (Should never happen theoretically)
+        {
+            num_free_blocks++;
+            num_allocated_blocks++;
+            num_free_bytes += res->size;
+            num_meta_data_bytes += _METADATA_SIZE;
+            num_allocated_bytes -= _METADATA_SIZE;
+        }
+        return block;
+    }
+
+    // Forget the sample of a block in use, if it was sampled, before it is freed or resized.
+    void unsample(_MallocMetaData* block)
+    {
+        if(block->flags & _BLOCK_SAMPLED)
+        {
+            block->flags &= ~_BLOCK_SAMPLED;
+            _profileFree(getPayload(block));
+        }
+    }
+
+    // Split the internal waste of a block in use into the bytes it was rounded up by, and its leftover.
+    void wasteOf(_MallocMetaData* block, size_t* round_up, size_t* leftover)
+    {
+        size_t waste = (block->flags & _WASTE_MASK) >> _WASTE_SHIFT;
+        size_t requested = block->size - waste;
+        size_t padded = ROUND_UP(requested) < _MIN_PAYLOAD? _MIN_PAYLOAD : ROUND_UP(requested);
+        *round_up = padded <= block->size? padded - requested : waste;
+        *leftover = waste - *round_up;
+    }
+
+    // Keep the internal waste of a block in use that was allocated (or resized) for requested bytes in its flags.
+    // The waste is below 256 bytes: up to 47 rounding bytes, and a leftover too small to split (< _MIN_SPLIT + _METADATA_SIZE).
+    void setWaste(_MallocMetaData* block, size_t requested)
+    {
+        size_t waste = block->size - requested > 255? 255 : block->size - requested;
+        block->flags = (block->flags & ~_WASTE_MASK) | (waste << _WASTE_SHIFT);
+
+        // Update statistics:
+        size_t round_up, leftover;
+        wasteOf(block, &round_up, &leftover);
+        num_round_up_bytes += round_up;
+        num_leftover_bytes += leftover;
+    }
+
+    // Forget the internal waste of a block in use before it is freed or resized.
+    void clearWaste(_MallocMetaData* block)
+    {
+        size_t round_up, leftover;
+        wasteOf(block, &round_up, &leftover);
+        block->flags &= ~_WASTE_MASK;
+
+        // Update statistics:
+        num_round_up_bytes -= round_up;
+        num_leftover_bytes -= leftover;
+    }
+    // $$$$$$$$$$ General Purpose $$$$$$$$$$ //
+
+    // ********** Heap Funcs ********** //
+    // These assume that heap_lock is held by the caller.
+    // If zero_start and zero_end are not null, they are set to a range of the payload that is known to be zero
+    // (it may reach past the size): new memory that was not written yet, or the released pages of a free block that
+    // is reused. They are left as they are if there is none.
+    void* _smalloc(size_t size, char** zero_start = nullptr, char** zero_end = nullptr)
+    {
+        size = ROUND_UP(size);
+        if(size < _MIN_PAYLOAD)
+        {
+            size = _MIN_PAYLOAD; // The block must be able to hold its tree links once it is freed.
+        }
+
+        _MallocMetaData* free_block = getFreeBlock(size);
+        if(free_block == nullptr) // If there is no free block that can contain size bytes
+        {
+            if(wilderness && isFree(wilderness)) // If the last block in the heap is free we can simply enlarge it:
+            {
+                char* clean = heap_clean;
+                _MallocMetaData* block = _extendWilderness(size);
+                if(block)
+                {
+                    if(zero_start)
+                    {
+                        *zero_start = std::max(clean, static_cast<char*>(getPayload(block)));
+                        *zero_end = static_cast<char*>(getPayload(block)) + block->size;
+                    }
+                    _COUNT_PATH(_PATH_WILDERNESS);
+                    return getPayload(block);
+                }
+            }
+
+            // Allocate space at the top of the heap (this is also how the first block is made):
+            size_t got;
+            char* clean = heap_clean;
+            _MallocMetaData* old_fence = fence;
+            _MallocMetaData* block = reinterpret_cast<_MallocMetaData*>(heapSbrk(size + _METADATA_SIZE, &got));
+            if(block == nullptr)
+            {
+                return NULL;
+            }
+            if(zero_start)
+            {
+                // Unless it continues the current segment, the block starts a new one that was just mapped:
+                *zero_start = static_cast<char*>(getPayload(block));
+                if(block == old_fence)
+                {
+                    *zero_start = std::max(clean, *zero_start);
+                }
+                *zero_end = reinterpret_cast<char*>(block) + got;
+            }
+
+            // Update the new wilderness block:
+            block->size = got - _METADATA_SIZE;
+            wilderness = block;
+
+            // Update statistics:
+            num_allocated_blocks++;
+            num_allocated_bytes += block->size;
+            num_meta_data_bytes += _METADATA_SIZE;
+            
+            _COUNT_PATH(_PATH_SBRK);
+            return getPayload(block);
+        }
+
+        // If there exists a free block that can contain size bytes:
+        _COUNT_PATH(_PATH_HIST_HIT);
+        if(zero_start && (free_block->flags & _BLOCK_RELEASED))
+        {
+            // The released pages were zeroed by madvise(), and nothing was written to them since:
+            size_t released = heapReleasable(free_block, zero_start);
+            *zero_end = *zero_start + released;
+        }
+        histRemove(free_block);
+        setFree(free_block, false);
+        _MallocMetaData* res = split(free_block, size);
+
+        // Update statistics:
+        if(!res)
+        {
+            // If split failed, then we have one less free block.
+            num_free_blocks--;
+            num_free_bytes -= free_block->size;
+        }
+        else
+        {
+            // If split was successful, we need to count _METADATA_SIZE less bytes in the total free bytes statistic.
+            num_free_bytes -= (size + _METADATA_SIZE);
+            num_allocated_bytes -= _METADATA_SIZE;
+            num_meta_data_bytes += _METADATA_SIZE;
+            num_allocated_blocks++;
+        }
+        return getPayload(free_block);
+    }
+
+    void _sfree(void* p)
+    {
+        _MallocMetaData* ptr = getMetaData(p);
+        if(ptr == nullptr || isFree(ptr))
+        {
+            return;
+        }
+        unsample(ptr);
+        clearWaste(ptr);
+        setFree(ptr, true);
+
+        // Update statistics (merge will update again if there are adjecent blocks that are also free)
+        num_free_blocks++;
+        num_free_bytes += ptr->size;
+
+        _MallocMetaData* new_block = ptr;
+        histInsert(ptr);
+        mergeFree(ptr, &new_block); // Merge updates the statistics assuming that block is free.
+        heapRelease(new_block);
+        heapTrim();
+    }
+
+    /**
+     * Allocate n blocks of size bytes into out, and return how many were allocated (less than n if the heap ran out).
+     * The blocks are carved back to back from a single block that is large enough for a group of them, so a group
+     * costs one search of the hist (or one growth of the heap). A group is kept below the mmap threshold.
+     */
+    size_t _smallocBatch(size_t size, size_t n, size_t max_group, void** out)
+    {
+        size = ROUND_UP(size);
+        if(size < _MIN_PAYLOAD)
+        {
+            size = _MIN_PAYLOAD; // The block must be able to hold its tree links once it is freed.
+        }
+        size_t stride = size + _METADATA_SIZE;
+        if(max_group < 1)
+        {
+            max_group = 1;
+        }
+
+        size_t done = 0;
+        while(done < n)
+        {
+            size_t group = n - done < max_group? n - done : max_group;
+            void* p = _smalloc(group * stride - _METADATA_SIZE);
+            if(p == nullptr)
+            {
+                break;
+            }
+
+            // Carve the block into the group: the first keeps its header, and the last gets any leftover of it.
+            _MallocMetaData* block = getMetaData(p);
+            size_t total = block->size;
+            bool was_wilderness = (block == wilderness);
+            for(size_t i = 0; i < group; i++)
+            {
+                _MallocMetaData* carved = reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(block) + i * stride);
+                if(i > 0)
+                {
+                    carved->flags = 0; // The block before it is in use.
+                }
+                carved->size = (i == group - 1)? total - i * stride : size;
+                out[done + i] = getPayload(carved);
+            }
+            if(was_wilderness)
+            {
+                wilderness = getMetaData(out[done + group - 1]);
+            }
+
+            // Update statistics:
+            num_allocated_blocks += group - 1;
+            num_meta_data_bytes += (group - 1) * _METADATA_SIZE;
+            num_allocated_bytes -= (group - 1) * _METADATA_SIZE;
+            done += group;
+        }
+        return done;
+    }
+
+    /**
+     * Free n blocks of the arena, whose addresses are sorted. Blocks of the batch that are next to each other in memory
+     * are joined while they are still in use, so each run of them is inserted into the hist and merged with its
+     * free neighbours once. The wilderness is trimmed once, at the end.
+     */
+    void _sfreeBatch(void** ptrs, size_t n)
+    {
+        for(size_t i = 0; i < n; i++)
+        {
+            _MallocMetaData* block = getMetaData(ptrs[i]);
+            if(block == nullptr || isFree(block))
+            {
+                continue;
+            }
+            unsample(block);
+            clearWaste(block);
+
+            // Absorb the following blocks of the batch (skipping repeated pointers) while they are adjacent:
+            while(i + 1 < n)
+            {
+                if(ptrs[i + 1] == ptrs[i])
+                {
+                    i++;
+                    continue;
+                }
+                _MallocMetaData* next = getNext(block);
+                if(next != getMetaData(ptrs[i + 1]) || isFree(next))
+                {
+                    break;
+                }
+                unsample(next);
+                clearWaste(next);
+                if(next == wilderness)
+                {
+                    wilderness = block;
+                }
+                block->size += next->size + _METADATA_SIZE;
+                i++;
+
+                // Update statistics:
+                num_allocated_blocks--;
+                num_meta_data_bytes -= _METADATA_SIZE;
+                num_allocated_bytes += _METADATA_SIZE;
+            }
+
+            setFree(block, true);
+
+            // Update statistics (merge will update again if there are adjecent blocks that are also free)
+            num_free_blocks++;
+            num_free_bytes += block->size;
+
+            _MallocMetaData* new_block = block;
+            histInsert(block);
+            mergeFree(block, &new_block); // Merge updates the statistics assuming that block is free.
+            heapRelease(new_block);
+        }
+        heapTrim();
+    }
+
+    // Allocate a block whose payload is aligned to alignment (a power of 2 above 8).
+    // A larger block is allocated, and the slack before and after the aligned payload is split off as free blocks.
+    void* _smemalign(size_t alignment, size_t size)
+    {
+        size = ROUND_UP(size);
+        if(size < _MIN_PAYLOAD)
+        {
+            size = _MIN_PAYLOAD; // The block must be able to hold its tree links once it is freed.
+        }
+
+        // Leave room for a free block before the aligned payload, for any address that the block gets:
+        void* p = _smalloc(size + alignment + _METADATA_SIZE + _MIN_PAYLOAD);
+        if(p == nullptr)
+        {
+            return nullptr;
+        }
+        _MallocMetaData* block = getMetaData(p);
+
+        uintptr_t payload = reinterpret_cast<uintptr_t>(p);
+        if(payload & (alignment - 1))
+        {
+            uintptr_t aligned = (payload + _METADATA_SIZE + _MIN_PAYLOAD + alignment - 1) & ~(alignment - 1);
+            _MallocMetaData* front = block;
+            block = splitFront(block, aligned - payload);
+
+            // Update statistics:
+            num_free_blocks++;
+            num_free_bytes += front->size;
+            num_allocated_blocks++;
+            num_meta_data_bytes += _METADATA_SIZE;
+            num_allocated_bytes -= _METADATA_SIZE;
+
+            mergeFree(front, &front); // (The block before it may be free)
+        }
+
+        _MallocMetaData* rest = split(block, size);
+        if(rest)
+        {
+            freeSplitRest(rest);
+        }
+        return getPayload(block);
+    }
+
+    // Resize a heap block in place, or by merging it with its free neighbours.
+    // Return nullptr if it can not be done, so the block must be moved.
+    void* _srealloc(void* oldp, size_t size)
+    {
+        size = ROUND_UP(size);
+        if(size < _MIN_PAYLOAD)
+        {
+            size = _MIN_PAYLOAD; // The block must be able to hold its tree links once it is freed.
+        }
+
+        _MallocMetaData* oldmeta = reinterpret_cast<_MallocMetaData*>(getMetaData(oldp));
+        unsample(oldmeta); // (The header may move, the caller samples the block again if it wants to)
+        size_t old_size = oldmeta->size;
+        _MallocMetaData* prev = getFreePrev(oldmeta);
+        _MallocMetaData* next = getNext(oldmeta);
+
+        // A: Try to reuse the current block without any merging:
+        if(size <= oldmeta->size)
+        {
+            _MallocMetaData* new_block = split(oldmeta, size);
+            if(new_block)
+            {
+                freeSplitRest(new_block);
+                heapTrim();
+            }
+            _COUNT_PATH(_PATH_REALLOC_A);
+            return oldp;
+        }
+
+        // B: Try to merge with the adjacent block with the LOWER address:
+        else if(prev && (oldmeta->size + prev->size + _METADATA_SIZE >= size))
+        {
+            // We can merge the left block with our block.
+            _MallocMetaData* new_block = nullptr;
+
+            // Update statistics:
+            num_meta_data_bytes -= _METADATA_SIZE;
+            num_allocated_bytes += _METADATA_SIZE;
+            num_free_bytes -= prev->size;
+            num_free_blocks--;
+            num_allocated_blocks--;
+            
+            histRemove(prev);
+            _mergeToPrev(oldmeta, &new_block, false);
+
+            // Copy the data to the new address:
+            memmove(getPayload(new_block), oldp, old_size);
+
+            _MallocMetaData* splitted = split(new_block, size);
+            if(splitted)
+            {
+                freeSplitRest(splitted);
+            }
+            _COUNT_PATH(_PATH_REALLOC_B);
+            return getPayload(new_block);
+        }
+
+        // C: Try to merge with the adjacent block wit hthe HIGHER address:
+        else if(isFree(next) && (oldmeta->size + next->size + _METADATA_SIZE >= size))
+        {
+            // We can merge the right block with our block.
+            _MallocMetaData* new_block = nullptr;
+
+            // Update statistics:
+            num_meta_data_bytes -= _METADATA_SIZE;
+            num_allocated_bytes += _METADATA_SIZE;
+            num_free_bytes -= next->size;
+            num_free_blocks--;
+            num_allocated_blocks--;
+            
+            histRemove(next);
+            _mergeToNext(oldmeta, &new_block, false);
+
+            _MallocMetaData* splitted = split(new_block, size);
+            if(splitted)
+            {
+                freeSplitRest(splitted);
+            }
+            _COUNT_PATH(_PATH_REALLOC_C);
+            return getPayload(new_block);
+        }
+
+        // D: Try to merge all those THREE adjacent blocks together:
+        else if(prev && isFree(next) && (oldmeta->size + prev->size + next->size + 2 * _METADATA_SIZE >= size))
+        {
+            // We can merge the left block with our block.
+            _MallocMetaData* new_block = nullptr;
+
+            // Update statistics:
+            num_meta_data_bytes -= 2 * _METADATA_SIZE;
+            num_allocated_bytes += 2 * _METADATA_SIZE;
+            num_free_bytes -= (prev->size + next->size);
+            num_free_blocks -= 2;
+            num_allocated_blocks -= 2;
+            
+            histRemove(prev);
+            histRemove(next);
+            _mergeToSurrounding(oldmeta, &new_block, false);
+
+            // Copy the data to the new address (before the split, which may write over the old payload):
+            memmove(getPayload(new_block), oldp, old_size);
+
+            _MallocMetaData* splitted = split(new_block, size);
+            if(splitted)
+            {
+                freeSplitRest(splitted);
+            }
+            _COUNT_PATH(_PATH_REALLOC_D);
+            return getPayload(new_block);
+        }
+
+        // A-D Failed, so check if we are trying to realloc wilderness, and extend it if so.
+        if(oldmeta == wilderness)
+        {
+            _MallocMetaData* block = _extendWilderness(size);
+            if(block)
+            {
+                _COUNT_PATH(_PATH_REALLOC_WILDERNESS);
+                return getPayload(block);
+            }
+        }
+
+        // Otherwise (or if the wilderness could not be extended in place), the block must be moved:
+        return nullptr;
+    }
+    // $$$$$$$$$$ Heap Funcs $$$$$$$$$$ //
+
+public:
+    _Arena() :
+    id(0), head(nullptr), fl_bitmap(0), sl_bitmap(), wilderness(nullptr), fence(nullptr), heap_reserve(0),
+    heap_chunk(_HEAP_CHUNK), heap_chunk_min(_HEAP_CHUNK), heap_chunk_max(_HEAP_CHUNK_MAX), segment_break(nullptr),
+    segment_committed(nullptr), segment_end(nullptr), heap_clean(nullptr), segment_huge(false), huge_pages(false), num_free_blocks(0),
+    num_free_bytes(0), num_allocated_blocks(0), num_allocated_bytes(0), num_meta_data_bytes(0), num_trimmed_bytes(0),
+    num_released_bytes(0), num_huge_bytes(0), num_round_up_bytes(0), num_leftover_bytes(0), trim_threshold(_TRIM_THRESHOLD),
+    top_pad(_TOP_PAD)
+    {
+    }
+
+    _Arena(_Arena& other) = delete; // disable copy ctor
+    void operator=(_Arena const &) = delete; // disable = operator
+
+    // The index of the arena, which marks its segments in the page map. Set once, before it is used.
+    void setId(uint8_t index)
+    {
+        id = index;
+    }
+
+    // Hold the heap lock across fork(), so that the child never inherits it in the middle of an update.
+    void lockHeap()
+    {
+        heap_lock.lock();
+    }
+
+    void unlockHeap()
+    {
+        heap_lock.unlock();
+    }
+
+    // ********** Main Funcs ********** //
+    // The size must not be above the mmap threshold.
+    void* smalloc(size_t size)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        void* p = _smalloc(size);
+        if(p)
+        {
+            setWaste(getMetaData(p), size);
+        }
+        return p;
+    }
+
+    // Allocate a block of size bytes and clear them, skipping the memory that is known to be zero.
+    // The size must not be above the mmap threshold.
+    void* scalloc(size_t size)
+    {
+        char* zero_start = nullptr;
+        char* zero_end = nullptr;
+        char* p;
+        {
+            std::lock_guard<std::mutex> guard(heap_lock);
+            p = static_cast<char*>(_smalloc(size, &zero_start, &zero_end));
+            if(p == nullptr)
+            {
+                return nullptr;
+            }
+            setWaste(getMetaData(p), size);
+        }
+
+        // The block is cleared without the lock, around the part of it that is zero:
+        char* end = p + size;
+        zero_start = std::max(zero_start, p);
+        zero_end = std::min(zero_end, end);
+        if(zero_start >= zero_end)
+        {
+            memset(p, 0, size);
+        }
+        else
+        {
+            memset(p, 0, zero_start - p);
+            memset(zero_end, 0, end - zero_end);
+        }
+        return p;
+    }
+
+    // The alignment must be a power of 2 above 8.
+    void* smemalign(size_t alignment, size_t size)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        void* p = _smemalign(alignment, size);
+        if(p)
+        {
+            setWaste(getMetaData(p), size);
+        }
+        return p;
+    }
+
+    // Free a heap block of the arena. (A block that is already free is ignored)
+    void sfree(void* p)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        _sfree(p);
+    }
+
+    // Allocate up to n blocks into out (in groups of at most max_group blocks), and return how many were allocated.
+    size_t smallocBatch(size_t size, size_t n, size_t max_group, void** out)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        size_t done = _smallocBatch(size, n, max_group, out);
+        for(size_t i = 0; i < done; i++)
+        {
+            setWaste(getMetaData(out[i]), size);
+        }
+        return done;
+    }
+
+    // Free n blocks of the arena, whose addresses are sorted.
+    void sfreeBatch(void** ptrs, size_t n)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        _sfreeBatch(ptrs, n);
+    }
+
+    // Resize a heap block of the arena for requested bytes (size is requested rounded up), without moving its
+    // payload elsewhere. Return nullptr if the block must be moved, and set old_size to its size.
+    void* srealloc(void* oldp, size_t size, size_t requested, size_t* old_size)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        _MallocMetaData* oldmeta = getMetaData(oldp);
+        size_t old_requested = oldmeta->size - ((oldmeta->flags & _WASTE_MASK) >> _WASTE_SHIFT);
+        clearWaste(oldmeta);
+        void* newp = _srealloc(oldp, size);
+        if(!newp)
+        {
+            setWaste(oldmeta, old_requested); // (The block was not changed)
+            *old_size = oldmeta->size;
+            return nullptr;
+        }
+        setWaste(getMetaData(newp), requested);
+        return newp;
+    }
+
+    // Mark a heap block of the arena in use as sampled by the heap profiler.
+    void markSampled(void* p)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        getMetaData(p)->flags |= _BLOCK_SAMPLED; // (Its neighbours write its _BLOCK_PREV_FREE flag under the lock)
+    }
+    // $$$$$$$$$$ Main Funcs $$$$$$$$$$ //
+
+    // ********** Stats Getters ********** //
+    // Add the statistics of the arena to stats.
+    void addStats(_HeapStats* stats) const
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        stats->free_blocks += num_free_blocks;
+        stats->free_bytes += num_free_bytes;
+        stats->allocated_blocks += num_allocated_blocks;
+        stats->allocated_bytes += num_allocated_bytes;
+        stats->meta_data_bytes += num_meta_data_bytes;
+        stats->trimmed_bytes += num_trimmed_bytes;
+        stats->released_bytes += num_released_bytes;
+        stats->reserved_bytes += heap_reserve;
+        stats->huge_bytes += num_huge_bytes;
+        stats->round_up_bytes += num_round_up_bytes;
+        stats->leftover_bytes += num_leftover_bytes;
+    }
+
+    // Add the free blocks and the internal waste of the arena to fragmentation, from its statistics and its hist.
+    // Takes constant time (the depth of a trie), so it can be polled.
+    void addFragmentation(_HeapFragmentation* fragmentation)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        fragmentation->free_blocks += num_free_blocks;
+        fragmentation->free_bytes += num_free_bytes;
+        fragmentation->round_up_waste += num_round_up_bytes;
+        fragmentation->leftover_waste += num_leftover_bytes;
+        if(fl_bitmap)
+        {
+            int fl = 31 - __builtin_clz(fl_bitmap);
+            int index = fl * _SL_COUNT + 31 - __builtin_clz(sl_bitmap[fl]);
+            size_t largest = histTreeMax(hist[index].root)->size;
+            if(largest > fragmentation->largest_free_block)
+            {
+                fragmentation->largest_free_block = largest;
+            }
+        }
+    }
+
+    // Walk the blocks of the heap of the arena in address order, segment by segment, and add them to walk.
+    void addWalk(_HeapWalk* walk)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        _MallocMetaData* block = head;
+        while(block)
+        {
+            if(block->flags & _BLOCK_FENCE)
+            {
+                block = reinterpret_cast<_MallocMetaData*>(block->size); // The first block of the next segment.
+                continue;
+            }
+            if(isFree(block))
+            {
+                int index = histIndex(block->size);
+                walk->bucket_blocks[index]++;
+                walk->bucket_bytes[index] += block->size;
+                walk->summary.free_blocks++;
+                walk->summary.free_bytes += block->size;
+                if(block->size > walk->summary.largest_free_block)
+                {
+                    walk->summary.largest_free_block = block->size;
+                }
+            }
+            else
+            {
+                size_t round_up, leftover;
+                wasteOf(block, &round_up, &leftover);
+                walk->used_blocks++;
+                walk->used_bytes += block->size;
+                walk->summary.round_up_waste += round_up;
+                walk->summary.leftover_waste += leftover;
+            }
+            block = getNext(block);
+        }
+        for(int i = 0; i < _HIST_SIZE; i++)
+        {
+            walk->bucket_min_size[i] = histMinSize(i);
+        }
+    }
+    // $$$$$$$$$$ Stat Getters $$$$$$$$$$ //
+
+    // ********** Tuning ********** //
+    // A free wilderness of at least threshold bytes is trimmed back to top_pad bytes.
+    // The top_pad must leave room for a free block, and is kept below the threshold so there is a gap between them.
+    void setTrimThreshold(size_t threshold)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        trim_threshold = threshold;
+        if(top_pad >= trim_threshold)
+        {
+            top_pad = trim_threshold / 2 < _MIN_PAYLOAD? _MIN_PAYLOAD : trim_threshold / 2;
+        }
+    }
+
+    void setTopPad(size_t pad)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        top_pad = pad < _MIN_PAYLOAD? _MIN_PAYLOAD : pad;
+        if(trim_threshold <= top_pad)
+        {
+            trim_threshold = 2 * top_pad;
+        }
+    }
+
+    // The heap grows by chunk bytes at first, and the chunk doubles on each growth up to max_chunk bytes.
+    void setHeapGrowth(size_t chunk, size_t max_chunk)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        heap_chunk = chunk;
+        heap_chunk_min = chunk;
+        heap_chunk_max = max_chunk < chunk? chunk : max_chunk;
+    }
+
+    // Back the segments that are reserved from now on with huge pages (or stop doing so).
+    void setHugePages(bool enable)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        huge_pages = enable;
+    }
+
+    // Keep the trim threshold at least at threshold (the adaptive mmap threshold keeps it above itself).
+    void raiseTrimThreshold(size_t threshold)
+    {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        if(trim_threshold < threshold)
+        {
+            trim_threshold = threshold;
+        }
+    }
+    // $$$$$$$$$$ Tuning $$$$$$$$$$ //
+};
+
+// The singleton class of the allocator, used to manage all allocations:
+// Heap blocks come from the arenas, while the mmapped blocks, the slab runs and the thread caches are shared.
+class _AllocList : private _BlockAccess, private _PageMap
+{
+private:
+    _MallocMetaData* mmap_head; // The head of the mmapped structs' unordered doubly linked list
+    _Arena arenas[_MAX_ARENAS];
+    size_t num_arenas;
+    std::atomic<size_t> next_arena; // The arena that the next thread is assigned to (modulo num_arenas).
+
+    // The statistics of the mmapped blocks and the slab runs (the heap of each arena counts its own):
+    size_t num_free_blocks;
+    size_t num_free_bytes;
+    size_t num_allocated_blocks;
+    size_t num_allocated_bytes;
+    size_t num_meta_data_bytes;
+    size_t size_meta_data;
+    std::atomic<size_t> mmap_threshold; // Larger blocks are mmapped. Rises as mmapped blocks are freed, unless it was set explicitly.
+    bool mmap_threshold_fixed;
+    bool huge_pages; // Mmapped blocks of at least a huge page are backed by huge pages.
+    size_t num_huge_bytes; // The bytes of the mappings of the mmapped blocks that are backed by huge pages.
+
+    _MmapCacheEntry* mmap_cache[_MMAP_CACHE_BINS]; // Mappings of freed mmapped blocks, kept for reuse by size.
+    _MmapCacheEntry* mmap_cache_newest;
+    _MmapCacheEntry* mmap_cache_oldest;
+    size_t mmap_cached_bytes;
+    size_t mmap_cache_limit;
+    uint64_t mmap_cache_max_age;
+    size_t num_mmap_cache_hits;
+    size_t num_mmap_cache_misses;
+
+    // Guards the mmapped blocks, the slab runs and the list of thread caches. The thread caches' lists are only touched
+    // by their owners. It may be held while taking the lock of an arena, but not the other way around.
+    mutable std::mutex global_lock;
+    _ThreadCache* tcache_head; // The list of all the thread caches, in use or waiting to be reused.
+    pthread_key_t tcache_key; // Used to flush the cache of a thread when it exits.
+    _SlabRun* abandoned[_TCACHE_CLASSES]; // Per class, the runs whose owner exited.
+    _SlabRun* free_runs; // Empty runs that are kept mapped for reuse.
+    size_t num_free_runs;
+
+    _AllocList() : 
+    mmap_head(nullptr), num_arenas(1), next_arena(0), num_free_blocks(0), num_free_bytes(0), num_allocated_blocks(0),
+    num_allocated_bytes(0), num_meta_data_bytes(0), size_meta_data(_METADATA_SIZE), mmap_threshold(_MAX_ALLOC),
+    mmap_threshold_fixed(false), huge_pages(false), num_huge_bytes(0),
+    mmap_cache(), mmap_cache_newest(nullptr), mmap_cache_oldest(nullptr), mmap_cached_bytes(0), mmap_cache_limit(_MMAP_CACHE_LIMIT),
+    mmap_cache_max_age(_MMAP_CACHE_MAX_AGE), num_mmap_cache_hits(0), num_mmap_cache_misses(0), tcache_head(nullptr),
+    abandoned(), free_runs(nullptr), num_free_runs(0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if(cpus > 1)
+        {
+            num_arenas = cpus > _MAX_ARENAS? _MAX_ARENAS : cpus;
+        }
+        for(size_t i = 0; i < _MAX_ARENAS; i++)
+        {
+            arenas[i].setId(i);
+        }
+        pthread_key_create(&tcache_key, tcacheTeardown);
+        pthread_atfork(forkPrepare, forkParent, forkChild);
+    }
+
+    _AllocList(_AllocList& other) = delete; // disable copy ctor
+    void operator=(_AllocList const &) = delete; // disable = operator
+
+    // Check whether a block of the given size is allocated with mmap() rather than on the heap.
+    inline bool isMmappedSize(size_t size)
+    {
+        return size > mmap_threshold.load(std::memory_order_relaxed);
+    }
+
+    // ********** Mmap List Methods ********** //
+    void mmapInsert(_MallocMetaData* to_insert)
+    {
+        if (!to_insert || !isMmappedBlock(to_insert))
+        {
+            return;
+        }
+        _MmapLinks* links = getMmapLinks(to_insert);
+        if(mmap_head == nullptr) // This is the first mmapped region, add it.
+        {
+            mmap_head = to_insert;
+            links->next = nullptr;
+            links->prev = nullptr;
+            return;
+        }
+        // otherwise, we will insert it in the head of the list.
+        links->next = mmap_head;
+        links->prev = nullptr;
+        getMmapLinks(mmap_head)->prev = to_insert;
+        mmap_head = to_insert;
+        return;
+    }
+
+    void mmapRemove(_MallocMetaData* to_remove)
+    {
+        _MmapLinks* links = getMmapLinks(to_remove);
+        if(to_remove == mmap_head && links->next == nullptr)
+        {
+            // This is both the first and last member of the list.
+            mmap_head = nullptr; // Empty the list.
+            return;
+        }
+        else if (to_remove == mmap_head)
+        {
+            // This is the first but not last member of the list.
+            getMmapLinks(links->next)->prev = nullptr;
+            mmap_head = links->next;
+            return;
+        }
+        // This is not the first member of the list.
+        getMmapLinks(links->prev)->next = links->next;
+        if(links->next != nullptr) // It's not the last member of the list.
+        {
+            getMmapLinks(links->next)->prev = links->prev;
+        }
+        return;
+    }
+    // $$$$$$$$$$ Mmap List Methods $$$$$$$$$$ //
+
+    // ********** Mmap Cache Methods ********** //
+    // The mappings of freed mmapped blocks are kept for a while, so that buffers that are freed and allocated
+    // again do not pay for munmap(), mmap() and the page faults each time.
+    // The cache is bounded by mmap_cache_limit bytes, and a mapping that was not reused for mmap_cache_max_age
+    // milliseconds is unmapped on the next mmap allocation or free.
+    uint64_t mmapCacheNow()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+    }
+
+    int mmapCacheBin(size_t length)
+    {
+        int bin = (63 - __builtin_clzl(length)) - 17;
+        if(bin < 0)
+        {
+            return 0;
+        }
+        return bin >= _MMAP_CACHE_BINS? _MMAP_CACHE_BINS - 1 : bin;
+    }
+
+    void mmapCacheRemove(_MmapCacheEntry* entry)
+    {
+        int bin = mmapCacheBin(entry->length);
+        if(entry->prev_bin) entry->prev_bin->next_bin = entry->next_bin;
+        else mmap_cache[bin] = entry->next_bin;
+        if(entry->next_bin) entry->next_bin->prev_bin = entry->prev_bin;
+
+        if(entry->newer) entry->newer->older = entry->older;
+        else mmap_cache_newest = entry->older;
+        if(entry->older) entry->older->newer = entry->newer;
+        else mmap_cache_oldest = entry->newer;
+
+        mmap_cached_bytes -= entry->length;
+    }
+
+    // Unmap the cached mappings that are too old, and the oldest ones until there is room for extra more bytes.
+    void mmapCacheEvict(size_t extra)
+    {
+        uint64_t now = mmapCacheNow();
+        while(mmap_cache_oldest && (now - mmap_cache_oldest->cached_at > mmap_cache_max_age || mmap_cached_bytes + extra > mmap_cache_limit))
+        {
+            _MmapCacheEntry* entry = mmap_cache_oldest;
+            mmapCacheRemove(entry);
+            munmap(entry, entry->length);
+        }
+    }
+
+    // Keep the mapping of a freed mmapped block in the cache. Return false if it does not fit, so it should be unmapped.
+    bool mmapCachePut(void* mapping, size_t length, bool huge)
+    {
+        if(length > mmap_cache_limit)
+        {
+            return false;
+        }
+        mmapCacheEvict(length);
+
+        _MmapCacheEntry* entry = reinterpret_cast<_MmapCacheEntry*>(mapping);
+        int bin = mmapCacheBin(length);
+        entry->length = length;
+        entry->huge = huge;
+        entry->cached_at = mmapCacheNow();
+        entry->prev_bin = nullptr;
+        entry->next_bin = mmap_cache[bin];
+        if(mmap_cache[bin]) mmap_cache[bin]->prev_bin = entry;
+        mmap_cache[bin] = entry;
+        entry->newer = nullptr;
+        entry->older = mmap_cache_newest;
+        if(mmap_cache_newest) mmap_cache_newest->newer = entry;
+        else mmap_cache_oldest = entry;
+        mmap_cache_newest = entry;
+
+        mmap_cached_bytes += length;
+        return true;
+    }
+
+    // Take the best fitting cached mapping of at least length bytes (and not much longer) out of the cache,
+    // and set got to its length (and huge to whether it is backed by huge pages). Return nullptr if there is none.
+    void* mmapCacheGet(size_t length, size_t* got, bool* huge)
+    {
+        mmapCacheEvict(0);
+
+        size_t max_length = length + (length >> _MMAP_CACHE_MAX_WASTE);
+        _MmapCacheEntry* best = nullptr;
+        for(int bin = mmapCacheBin(length); bin <= mmapCacheBin(max_length); bin++)
+        {
+            for(_MmapCacheEntry* entry = mmap_cache[bin]; entry; entry = entry->next_bin)
+            {
+                if(entry->length >= length && entry->length <= max_length && (!best || entry->length < best->length))
+                {
+                    best = entry;
+                }
+            }
+        }
+
+        if(!best)
+        {
+            num_mmap_cache_misses++;
+            return nullptr;
+        }
+        num_mmap_cache_hits++;
+        mmapCacheRemove(best);
+        *got = best->length;
+        *huge = best->huge;
+        return best;
+    }
+    // $$$$$$$$$$ Mmap Cache Methods $$$$$$$$$$ //
+
+    // ********** Arena Methods ********** //
+    // Return the arena of the calling thread. Threads are assigned to the arenas round robin on first use.
+    _Arena* getArena()
+    {
+        if(_tarena == nullptr)
+        {
+            _tarena = &arenas[next_arena.fetch_add(1, std::memory_order_relaxed) % num_arenas];
+        }
+        return _tarena;
+    }
+
+    // Sum the statistics of all the arenas (locking each of them in turn).
+    _HeapStats arenaTotals() const
+    {
+        _HeapStats stats;
+        for(size_t i = 0; i < num_arenas; i++)
+        {
+            arenas[i].addStats(&stats);
+        }
+        return stats;
+    }
+    // $$$$$$$$$$ Arena Methods $$$$$$$$$$ //
+
+    // ********** Fork Handlers ********** //
+    // All the locks are taken before fork() (global_lock first, as everywhere else) and released on both sides of it,
+    // so the only thread of the child finds the allocator in a consistent state.
+    // The caches of the other threads are never torn down in the child; their runs just stay with them.
+    static void forkPrepare()
+    {
+        _AllocList& instance = getInstance();
+        instance.global_lock.lock();
+        for(size_t i = 0; i < instance.num_arenas; i++)
+        {
+            instance.arenas[i].lockHeap();
+        }
+        _profileForkLock();
+    }
+
+    static void forkParent()
+    {
+        _AllocList& instance = getInstance();
+        _profileForkUnlock();
+        for(size_t i = instance.num_arenas; i > 0; i--)
+        {
+            instance.arenas[i - 1].unlockHeap();
+        }
+        instance.global_lock.unlock();
+    }
+
+    static void forkChild()
+    {
+        forkParent();
+    }
+    // $$$$$$$$$$ Fork Handlers $$$$$$$$$$ //
+
+    // ********** Slab Run Methods ********** //
+    void runListInsert(_SlabRun** list, _SlabRun* run)
+    {
+        run->prev = nullptr;
+        run->next = *list;
+        if(*list)
+        {
+            (*list)->prev = run;
+        }
+        *list = run;
+    }
+
+    void runListRemove(_SlabRun** list, _SlabRun* run)
+    {
+        if(run->prev)
+        {
+            run->prev->next = run->next;
+        }
+        else
+        {
+            *list = run->next;
+        }
+        if(run->next)
+        {
+            run->next->prev = run->prev;
+        }
+    }
+
+    // Create an empty run for the class at index, reusing a free run if there is one. Assumes that global_lock is held.
+    // The objects of the new run are not counted as free - whoever takes the run counts them.
+    _SlabRun* slabCreateRun(int index)
+    {
+        void* base = free_runs;
+        if(base)
+        {
+            free_runs = free_runs->next;
+            num_free_runs--;
+        }
+        else
+        {
+            base = mapAligned(_RUN_SIZE, _RUN_SIZE);
+            if(base == nullptr)
+            {
+                return nullptr;
+            }
+            if(!pagemapSet(base, _RUN_SIZE, _CHUNK_RUN))
+            {
+                munmap(base, _RUN_SIZE);
+                return nullptr;
+            }
+        }
+
+        _SlabRun* run = new (base) _SlabRun();
+        run->size = CLASS_TO_SIZE(index);
+        run->index = index;
+        run->capacity = (_RUN_SIZE - _RUN_HEADER_SIZE) / run->size;
+        run->bump = reinterpret_cast<char*>(base) + _RUN_HEADER_SIZE;
+        run->end = run->bump + run->capacity * run->size;
+
+        // Update statistics:
+        num_allocated_blocks += run->capacity;
+        num_allocated_bytes += run->capacity * run->size;
+        num_meta_data_bytes += _RUN_HEADER_SIZE;
+        return run;
+    }
+
+    // Give back a run whose objects are all free: keep it for reuse, or unmap it. Assumes that global_lock is held.
+    // The caller must already have stopped counting the objects of the run as free.
+    void slabReleaseRun(_SlabRun* run)
+    {
+        // Update statistics:
+        num_allocated_blocks -= run->capacity;
+        num_allocated_bytes -= run->capacity * run->size;
+        num_meta_data_bytes -= _RUN_HEADER_SIZE;
+
+        if(num_free_runs < _MAX_FREE_RUNS)
+        {
+            run->next = free_runs;
+            free_runs = run;
+            num_free_runs++;
+            return;
+        }
+        pagemapSet(run, _RUN_SIZE, _CHUNK_NONE);
+        munmap(run, _RUN_SIZE);
+    }
+
+    // Pop an object of the given (rounded up) size from the runs of the cache, taking a new run if needed.
+    void* slabAlloc(_ThreadCache* cache, size_t size)
+    {
+        int index = SIZE_TO_CLASS(size);
+        _SlabRun* run = cache->runs[index];
+        if(run == nullptr)
+        {
+            tcacheDrainRemote(cache);
+            run = cache->runs[index];
+            if(run == nullptr)
+            {
+                run = slabAcquireRun(cache, index);
+                if(run == nullptr)
+                {
+                    return nullptr;
+                }
+            }
+        }
+
+        void* object;
+        if(run->free_list)
+        {
+            object = run->free_list;
+            run->free_list = run->free_list->next;
+        }
+        else
+        {
+            object = run->bump;
+            run->bump += run->size;
+        }
+        run->num_used++;
+        tcacheCountFree(cache, -1, -run->size);
+
+        if(run->num_used == run->capacity)
+        {
+            runListRemove(&cache->runs[index], run);
+            runListInsert(&cache->full_runs, run);
+        }
+        _COUNT_PATH(_PATH_TCACHE);
+        return object;
+    }
+
+    // Return an object to its run, which is owned by the cache.
+    void slabFree(_ThreadCache* cache, _SlabRun* run, void* object)
+    {
+        bool was_full = (run->num_used == run->capacity);
+        _CachedBlock* cached = reinterpret_cast<_CachedBlock*>(object);
+        cached->next = run->free_list;
+        run->free_list = cached;
+        run->num_used--;
+        tcacheCountFree(cache, 1, run->size);
+
+        if(was_full)
+        {
+            runListRemove(&cache->full_runs, run);
+            runListInsert(&cache->runs[run->index], run);
+        }
+        else if(run->num_used == 0 && run != cache->runs[run->index])
+        {
+            // Only the run at the head of the class list is kept when it empties, the others are given back:
+            runListRemove(&cache->runs[run->index], run);
+            tcacheCountFree(cache, -run->capacity, -(run->capacity * run->size));
+            std::lock_guard<std::mutex> guard(global_lock);
+            slabReleaseRun(run);
+        }
+    }
+
+    // Give the cache a run with free objects of the class at index: adopt an abandoned run, or create a new one.
+    _SlabRun* slabAcquireRun(_ThreadCache* cache, int index)
+    {
+        std::lock_guard<std::mutex> guard(global_lock);
+        _SlabRun* run = abandoned[index];
+        while(run && run->num_used == run->capacity)
+        {
+            run = run->next;
+        }
+
+        if(run)
+        {
+            runListRemove(&abandoned[index], run);
+            size_t free_objects = run->capacity - run->num_used;
+            num_free_blocks -= free_objects;
+            num_free_bytes -= free_objects * run->size;
+            tcacheCountFree(cache, free_objects, free_objects * run->size);
+        }
+        else
+        {
+            run = slabCreateRun(index);
+            if(run == nullptr)
+            {
+                return nullptr;
+            }
+            tcacheCountFree(cache, run->capacity, run->capacity * run->size);
+        }
+
+        run->owner.store(cache, std::memory_order_release);
+        runListInsert(&cache->runs[index], run);
+        return run;
+    }
+
+    // Hand a run of an exiting thread to the shared heap. Assumes that global_lock is held.
+    void slabAbandonRun(_ThreadCache* cache, _SlabRun* run)
+    {
+        size_t free_objects = run->capacity - run->num_used;
+        tcacheCountFree(cache, -free_objects, -(free_objects * run->size));
+        if(run->num_used == 0)
+        {
+            slabReleaseRun(run);
+            return;
+        }
+
+        run->owner.store(nullptr, std::memory_order_release);
+        num_free_blocks += free_objects;
+        num_free_bytes += free_objects * run->size;
+        runListInsert(&abandoned[run->index], run);
+    }
+
+    // Free an object of an abandoned run. Assumes that global_lock is held.
+    void slabFreeAbandoned(_SlabRun* run, void* object)
+    {
+        _CachedBlock* cached = reinterpret_cast<_CachedBlock*>(object);
+        cached->next = run->free_list;
+        run->free_list = cached;
+        run->num_used--;
+
+        // Update statistics:
+        num_free_blocks++;
+        num_free_bytes += run->size;
+
+        if(run->num_used == 0)
+        {
+            runListRemove(&abandoned[run->index], run);
+            num_free_blocks -= run->capacity;
+            num_free_bytes -= run->capacity * run->size;
+            slabReleaseRun(run);
+        }
+    }
+
+    // Free a slab object from any thread: straight to its run if the calling thread owns it,
+    // through the owner's remote list if another thread owns it, or under global_lock if the run is abandoned.
+    void slabRouteFree(_SlabRun* run, void* object)
+    {
+        while(true)
+        {
+            _ThreadCache* owner = run->owner.load(std::memory_order_acquire);
+            if(owner != nullptr && owner == _tcache)
+            {
+                slabFree(owner, run, object);
+                return;
+            }
+            else if(owner != nullptr)
+            {
+                tcacheRemoteFree(owner, run, object);
+                return;
+            }
+
+            std::lock_guard<std::mutex> guard(global_lock);
+            if(run->owner.load(std::memory_order_acquire) == nullptr) // The run may have been adopted meanwhile.
+            {
+                slabFreeAbandoned(run, object);
+                return;
+            }
+        }
+    }
+    // $$$$$$$$$$ Slab Run Methods $$$$$$$$$$ //
+
+    // ********** Thread Cache Methods ********** //
+    // Return the cache of the calling thread, creating it on first use.
+    // Return nullptr if the thread can not have a cache (it is exiting, or the cache could not be created).
+    _ThreadCache* getThreadCache()
+    {
+        if(_tcache == nullptr)
+        {
+            _tcache = _TCACHE_DISABLED; // Any allocation made while creating the cache will use the shared heap.
+            _ThreadCache* cache = tcacheCreate();
+            if(cache)
+            {
+                pthread_setspecific(tcache_key, cache);
+                _tcache = cache;
+            }
+        }
+        return _tcache == _TCACHE_DISABLED? nullptr : _tcache;
+    }
+
+    // Take a cache that was left by an exited thread, or map a new one.
+    _ThreadCache* tcacheCreate()
+    {
+        std::lock_guard<std::mutex> guard(global_lock);
+        for(_ThreadCache* cache = tcache_head; cache; cache = cache->next)
+        {
+            if(!cache->in_use)
+            {
+                cache->in_use = true;
+                return cache;
+            }
+        }
+
+        void* ptr = mmap(NULL, sizeof(_ThreadCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ptr == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        _ThreadCache* cache = new (ptr) _ThreadCache();
+        cache->in_use = true;
+        cache->next = tcache_head;
+        tcache_head = cache;
+        return cache;
+    }
+
+    // Called by pthread when a thread that has a cache exits: abandon all of its runs to the shared heap.
+    // The cache itself is kept, since other threads may still be freeing objects into its remote_head.
+    // Those are handed on to the right run when a new thread takes the cache.
+    static void tcacheTeardown(void* arg)
+    {
+        _AllocList& instance = getInstance();
+        _ThreadCache* cache = reinterpret_cast<_ThreadCache*>(arg);
+        instance.tcacheDrainRemote(cache);
+
+        std::lock_guard<std::mutex> guard(instance.global_lock);
+        for(int i = 0; i < _TCACHE_CLASSES; i++)
+        {
+            while(cache->runs[i])
+            {
+                _SlabRun* run = cache->runs[i];
+                instance.runListRemove(&cache->runs[i], run);
+                instance.slabAbandonRun(cache, run);
+            }
+        }
+        while(cache->full_runs)
+        {
+            _SlabRun* run = cache->full_runs;
+            instance.runListRemove(&cache->full_runs, run);
+            instance.slabAbandonRun(cache, run);
+        }
+
+        cache->in_use = false;
+        _tcache = _TCACHE_DISABLED;
+    }
+
+    // Hand an object back to the cache that owns its run, from a thread that is not the owner.
+    void tcacheRemoteFree(_ThreadCache* owner, _SlabRun* run, void* object)
+    {
+        _CachedBlock* cached = reinterpret_cast<_CachedBlock*>(object);
+        owner->num_remote_blocks.fetch_add(1, std::memory_order_relaxed);
+        owner->num_remote_bytes.fetch_add(run->size, std::memory_order_relaxed);
+
+        cached->next = owner->remote_head.load(std::memory_order_relaxed);
+        while(!owner->remote_head.compare_exchange_weak(cached->next, cached, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // Return all the objects that other threads freed to their runs.
+    void tcacheDrainRemote(_ThreadCache* cache)
+    {
+        if(cache->remote_head.load(std::memory_order_relaxed) == nullptr)
+        {
+            return;
+        }
+
+        _CachedBlock* cached = cache->remote_head.exchange(nullptr, std::memory_order_acquire);
+        while(cached)
+        {
+            _CachedBlock* next = cached->next;
+            _SlabRun* run = RUN_OF(cached);
+            cache->num_remote_blocks.fetch_sub(1, std::memory_order_relaxed);
+            cache->num_remote_bytes.fetch_sub(run->size, std::memory_order_relaxed);
+
+            if(run->owner.load(std::memory_order_acquire) == cache)
+            {
+                slabFree(cache, run, cached);
+            }
+            else
+            {
+                slabRouteFree(run, cached); // The run changed hands after the object was sent here.
+            }
+            cached = next;
+        }
+    }
+
+    // Add to the free objects statistics of the cache.
+    // Only the owner writes them, so there is no need for an atomic read-modify-write.
+    void tcacheCountFree(_ThreadCache* cache, ssize_t blocks, ssize_t bytes)
+    {
+        cache->num_blocks.store(cache->num_blocks.load(std::memory_order_relaxed) + blocks, std::memory_order_relaxed);
+        cache->num_bytes.store(cache->num_bytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+    }
+
+    // Sum the objects and bytes that are free in the runs of all the thread caches.
+    // Assumes that global_lock is held.
+    void tcacheTotals(size_t* blocks, size_t* bytes) const
+    {
+        *blocks = 0;
+        *bytes = 0;
+        for(_ThreadCache* cache = tcache_head; cache; cache = cache->next)
+        {
+            *blocks += cache->num_blocks.load(std::memory_order_relaxed) + cache->num_remote_blocks.load(std::memory_order_relaxed);
+            *bytes += cache->num_bytes.load(std::memory_order_relaxed) + cache->num_remote_bytes.load(std::memory_order_relaxed);
+        }
+    }
+    // $$$$$$$$$$ Thread Cache Methods $$$$$$$$$$ //
+
+    // ********** Mmap Funcs ********** //
+    // These assume that global_lock is held by the caller.
+    void* _smallocMmapped(size_t size)
+    {
+        size_t length;
+        bool huge;
+        void* ptr = mmapCacheGet(MMAP_LENGTH(size), &length, &huge);
+        _MallocMetaData* block;
+        if(ptr)
+        {
+            block = reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(ptr) + sizeof(_MmapLinks));
+            // The block gets the whole (slightly longer) cached mapping:
+            block->size = length - _MMAP_METADATA_SIZE;
+            block->flags = _BLOCK_MMAPPED | _BLOCK_RECYCLED | (huge? _BLOCK_HUGE : 0);
+            size = block->size;
+        }
+        else if(huge_pages && MMAP_LENGTH(size) >= _HUGE_PAGE_SIZE)
+        {
+            size_t flags;
+            length = MMAP_LENGTH(size);
+            ptr = mapHuge(&length, &flags);
+            if(ptr == nullptr)
+            {
+                return nullptr;
+            }
+            block = reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(ptr) + sizeof(_MmapLinks));
+            if(flags & _BLOCK_HUGETLB)
+            {
+                size = length - _MMAP_METADATA_SIZE; // The block gets the whole huge pages, so they are unmapped whole.
+            }
+            block->size = size;
+            block->flags = _BLOCK_MMAPPED | flags;
+        }
+        else
+        {
+            ptr = mmap(NULL, size + _MMAP_METADATA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(ptr == MAP_FAILED)
+            {
+                return nullptr;
+            }
+            block = reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(ptr) + sizeof(_MmapLinks));
+            block->size = size;
+            block->flags = _BLOCK_MMAPPED;
+        }
+        mmapInsert(block);
+        _COUNT_PATH((block->flags & _BLOCK_RECYCLED)? _PATH_MMAP_CACHED : _PATH_MMAP);
+
+        // Update statistics:
+        if(block->flags & _BLOCK_HUGE)
+        {
+            num_huge_bytes += MMAP_LENGTH(size);
+        }
+        num_allocated_blocks++;
+        num_allocated_bytes += size;
+        num_meta_data_bytes += _MMAP_METADATA_SIZE;
+        return getPayload(block);
+    }
+
+    void _sfreeMmapped(_MallocMetaData* ptr)
+    {
+        if(ptr->flags & _BLOCK_SAMPLED)
+        {
+            _profileFree(getPayload(ptr));
+        }
+
+        // Update statistics:
+        num_allocated_blocks--;
+        num_allocated_bytes -= ptr->size;
+        num_meta_data_bytes -= _MMAP_METADATA_SIZE;
+
+        // Like glibc, a freed mmapped block raises the threshold to its size, since such blocks
+        // keep being allocated and freed, and the heap can reuse them without any syscalls:
+        if(!mmap_threshold_fixed && ptr->size > mmap_threshold && ptr->size <= _MMAP_THRESHOLD_MAX)
+        {
+            mmap_threshold = ptr->size;
+            for(size_t i = 0; i < num_arenas; i++)
+            {
+                arenas[i].raiseTrimThreshold(2 * ptr->size);
+            }
+        }
+
+        size_t length;
+        void* mapping = mmapMapping(ptr, &length);
+        bool huge = ptr->flags & _BLOCK_HUGE;
+        if(huge)
+        {
+            num_huge_bytes -= length;
+        }
+
+        // Cache or unmap region (a MAP_HUGETLB mapping is not cached, since it can only be unmapped in whole huge pages):
+        mmapRemove(ptr);
+        if((ptr->flags & _BLOCK_HUGETLB) || !mmapCachePut(mapping, length, huge))
+        {
+            munmap(mapping, length);
+        }
+    }
+
+    // Map a block whose payload is aligned to alignment (a power of 2). The mapping is trimmed to the pages around the
+    // block, so its links and metadata may start in the middle of the first page.
+    void* _smemalignMmapped(size_t alignment, size_t size)
+    {
+        size_t length = ROUND_UP_PAGE(size + _MMAP_METADATA_SIZE + alignment);
+        void* ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ptr == MAP_FAILED)
+        {
+            return nullptr;
+        }
+
+        // Unmap the pages before the links and after the payload:
+        uintptr_t start = reinterpret_cast<uintptr_t>(ptr);
+        uintptr_t payload = (start + _MMAP_METADATA_SIZE + alignment - 1) & ~(alignment - 1);
+        uintptr_t first = (payload - _MMAP_METADATA_SIZE) & ~(_PAGE_SIZE - 1);
+        uintptr_t end = ROUND_UP_PAGE(payload + size);
+        if(first > start)
+        {
+            munmap(ptr, first - start);
+        }
+        if(start + length > end)
+        {
+            munmap(reinterpret_cast<void*>(end), start + length - end);
+        }
+
+        _MallocMetaData* block = getMetaData(reinterpret_cast<void*>(payload));
+        block->size = size;
+        block->flags = _BLOCK_MMAPPED;
+        mmapInsert(block);
+
+        // Update statistics:
+        num_allocated_blocks++;
+        num_allocated_bytes += size;
+        num_meta_data_bytes += _MMAP_METADATA_SIZE;
+        return getPayload(block);
+    }
+
+    // Grow or shrink a mmapped block with mremap(), so the payload is never copied (the mapping may move though).
+    // Return nullptr (and keep the block) if mremap() failed, or if the block is in MAP_HUGETLB pages.
+    void* _reallocMmapped(_MallocMetaData* block, size_t size)
+    {
+        if(block->flags & _BLOCK_HUGETLB)
+        {
+            return nullptr; // The mapping can only be resized in whole huge pages.
+        }
+
+        size_t old_size = block->size;
+        size_t old_length;
+        void* ptr = mmapMapping(block, &old_length);
+        size_t offset = reinterpret_cast<char*>(block) - reinterpret_cast<char*>(ptr); // Of an aligned block in its first page.
+        size_t new_length = ROUND_UP_PAGE(offset + _METADATA_SIZE + size);
+
+        // The neighbours in the mmap list point to the block, so it is taken out while it may move:
+        mmapRemove(block);
+        if(new_length != old_length)
+        {
+            ptr = mremap(ptr, old_length, new_length, MREMAP_MAYMOVE);
+            if(ptr == MAP_FAILED)
+            {
+                mmapInsert(block);
+                return nullptr;
+            }
+        }
+        block = reinterpret_cast<_MallocMetaData*>(reinterpret_cast<char*>(ptr) + offset);
+        block->size = size;
+        mmapInsert(block);
+
+        // Update statistics:
+        if(block->flags & _BLOCK_HUGE)
+        {
+            num_huge_bytes -= old_length;
+            num_huge_bytes += new_length;
+        }
+        num_allocated_bytes -= old_size;
+        num_allocated_bytes += size;
+        _COUNT_PATH(_PATH_REALLOC_MREMAP);
+        return getPayload(block);
+    }
+
+    // Move the payload of oldp (of old_size bytes) to a new block of the given size and free oldp.
+    // Return nullptr (and keep oldp) if the allocation failed. Takes the locks it needs.
+    void* reallocByCopy(void* oldp, size_t old_size, size_t size)
+    {
+        void* newp = smalloc(size);
+        if(!newp)
+        {
+            return nullptr;
+        }
+
+        memmove(newp, oldp, old_size > size? size : old_size);
+        sfree(oldp);
+        _COUNT_PATH(_PATH_REALLOC_COPY);
+        return newp;
+    }
+    // $$$$$$$$$$ Mmap Funcs $$$$$$$$$$ //
+
+public:
+    static _AllocList& getInstance()    // make _AllocList singleton
+    {
+        static _AllocList instance; // Guaranteed to be destroyed.
+        // Instantiated on first use.
+        return instance;
+    }
+    ~_AllocList() = default;
+
+    // ********** Main Funcs ********** //
+    void* smalloc(size_t size)
+    {
+        if(size == 0 || size > MAX_ALLOC_SIZE)
+        {
+            return NULL;
+        }
+
+        size_t requested = size;
+        size = ROUND_UP(size);
+
+        if(size <= _TCACHE_MAX_SIZE)
+        {
+            _ThreadCache* cache = getThreadCache();
+            if(cache)
+            {
+                return slabAlloc(cache, size);
+            }
+        }
+
+        if(isMmappedSize(size))
+        {
+            std::lock_guard<std::mutex> guard(global_lock);
+            return _smallocMmapped(size);
+        }
+        return getArena()->smalloc(requested); // (The arena rounds it up, and keeps how much it did)
+    }
+
+    // Allocate a block for an allocation that the heap profiler samples, and mark it as sampled.
+    // It is never a slab object, since those have no flags of their own.
+    void* smallocSampled(size_t size)
+    {
+        if(size == 0 || size > MAX_ALLOC_SIZE)
+        {
+            return NULL;
+        }
+
+        size_t requested = size;
+        size = ROUND_UP(size);
+        void* p;
+        if(isMmappedSize(size))
+        {
+            std::lock_guard<std::mutex> guard(global_lock);
+            p = _smallocMmapped(size);
+        }
+        else
+        {
+            p = getArena()->smalloc(requested);
+        }
+        if(p)
+        {
+            markSampled(p);
+        }
+        return p;
+    }
+
+    // Mark the block at p as sampled by the heap profiler. Return false if it is a slab object, which can not be marked.
+    bool markSampled(void* p)
+    {
+        uint8_t kind = pagemapLookup(p);
+        if(kind == _CHUNK_RUN)
+        {
+            return false;
+        }
+        if(kind >= _CHUNK_ARENA)
+        {
+            arenas[kind - _CHUNK_ARENA].markSampled(p);
+            return true;
+        }
+        std::lock_guard<std::mutex> guard(global_lock);
+        getMetaData(p)->flags |= _BLOCK_SAMPLED;
+        return true;
+    }
+    
+    // Allocate total bytes (the product of the arguments of scalloc(), which checks it for overflow) and clear them.
+    // Only the memory that is not known to be zero is cleared: a fresh mapping is zero already, and so is the new memory
+    // of a heap (see _Arena::scalloc()).
+    void* scalloc(size_t total, bool sampled)
+    {
+        if(total == 0 || total > MAX_ALLOC_SIZE)
+        {
+            return NULL;
+        }
+
+        // A heap block is cleared by its arena, which knows which of its memory is zero:
+        size_t rounded = ROUND_UP(total);
+        if(!sampled && !isMmappedSize(rounded) && (rounded > _TCACHE_MAX_SIZE || getThreadCache() == nullptr))
+        {
+            return getArena()->scalloc(total);
+        }
+
+        void* p = sampled? smallocSampled(total) : smalloc(total);
+        if(p == nullptr)
+        {
+            return nullptr;
+        }
+        // Fresh mappings are already zeroed, but recycled ones are not.
+        // (The flags of a mmapped block are only written when it is allocated, so they can be read without a lock)
+        bool is_zeroed = false;
+        if(pagemapLookup(p) == _CHUNK_NONE)
+        {
+            is_zeroed = !(getMetaData(p)->flags & _BLOCK_RECYCLED);
+        }
+        if(!is_zeroed)
+        {
+            memset(p, 0, total);
+        }
+        return p;
+    }
+
+    // Allocate size bytes at an address that is a multiple of alignment (a power of 2).
+    void* smemalign(size_t alignment, size_t size)
+    {
+        if(size == 0 || size > MAX_ALLOC_SIZE || alignment == 0 || (alignment & (alignment - 1)))
+        {
+            return NULL;
+        }
+        if(alignment <= 8)
+        {
+            return smalloc(size); // Every block is aligned to 8.
+        }
+
+        size_t requested = size;
+        size = ROUND_UP(size);
+        if(isMmappedSize(size + alignment + _METADATA_SIZE + _MIN_PAYLOAD))
+        {
+            std::lock_guard<std::mutex> guard(global_lock);
+            return _smemalignMmapped(alignment, size);
+        }
+        return getArena()->smemalign(alignment, requested);
+    }
+
+    void sfree(void* p)
+    {
+        if(p == nullptr)
+        {
+            return;
+        }
+
+        uint8_t kind = pagemapLookup(p);
+        if(kind == _CHUNK_RUN)
+        {
+            slabRouteFree(RUN_OF(p), p);
+            return;
+        }
+        if(kind >= _CHUNK_ARENA)
+        {
+            arenas[kind - _CHUNK_ARENA].sfree(p); // (A block that is already free is ignored)
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard(global_lock);
+        _sfreeMmapped(getMetaData(p));
+    }
+
+    // Free a block that was allocated with the given size. The block is found through the page map, which does not
+    // read its metadata, so a slab object is freed without touching any header but the one of its run.
+    // With the size, a slab object of the run that the calling thread allocates its class from is freed without a
+    // lookup in the page map or a load of the owner of the run: a run covers its whole chunk, so RUN_OF(p) can be
+    // compared with the run before anything is read. Any other block is freed by sfree().
+    void sfreeSized(void* p, size_t size)
+    {
+        assert(p == nullptr || size <= usableSize(p)); // The size must be the one the block was allocated with (or less).
+        size = ROUND_UP(size);
+        _ThreadCache* cache = _tcache;
+        if(p && size > 0 && size <= _TCACHE_MAX_SIZE && cache != nullptr && cache != _TCACHE_DISABLED)
+        {
+            _SlabRun* run = cache->runs[SIZE_TO_CLASS(size)];
+            if(run != nullptr && run == RUN_OF(p))
+            {
+                slabFree(cache, run, p);
+                return;
+            }
+        }
+        sfree(p);
+    }
+
+    // Return the number of bytes that can be used at p: the whole payload of its block, which may be more than
+    // was requested (the size is rounded up, and the rest of a block that was too small to split is kept).
+    size_t usableSize(void* p)
+    {
+        if(p == nullptr)
+        {
+            return 0;
+        }
+        if(pagemapLookup(p) == _CHUNK_RUN)
+        {
+            return RUN_OF(p)->size;
+        }
+        return getMetaData(p)->size; // (Only the owner of a block in use changes its size)
+    }
+
+    // Allocate n blocks of size bytes into out, and return how many were allocated (out[i] is NULL for the rest).
+    size_t smallocBatch(size_t size, size_t n, void** out)
+    {
+        size_t done = 0;
+        if(size == 0 || size > MAX_ALLOC_SIZE)
+        {
+            n = 0;
+        }
+        size_t requested = size;
+        size = ROUND_UP(size);
+
+        _ThreadCache* cache = size <= _TCACHE_MAX_SIZE? getThreadCache() : nullptr;
+        if(cache)
+        {
+            for(; done < n; done++)
+            {
+                out[done] = slabAlloc(cache, size);
+                if(out[done] == nullptr)
+                {
+                    break;
+                }
+            }
+        }
+        else if(isMmappedSize(size))
+        {
+            std::lock_guard<std::mutex> guard(global_lock);
+            for(; done < n; done++)
+            {
+                out[done] = _smallocMmapped(size);
+                if(out[done] == nullptr)
+                {
+                    break;
+                }
+            }
+        }
+        else if(n > 0)
+        {
+            // The blocks of a group are carved from a single heap block, which must stay below the mmap threshold:
+            size_t max_group = (mmap_threshold.load(std::memory_order_relaxed) + _METADATA_SIZE) / (size + _METADATA_SIZE);
+            done = getArena()->smallocBatch(requested, n, max_group, out);
+        }
+
+        for(size_t i = done; i < n; i++)
+        {
+            out[i] = NULL;
+        }
+        return done;
+    }
+
+    // Free n blocks. The array is sorted by address in place, so that the blocks of each arena are freed under
+    // a single lock, and adjacent blocks are coalesced before they are freed. A repeated pointer is freed once.
+    void sfreeBatch(void** ptrs, size_t n)
+    {
+        std::sort(ptrs, ptrs + n);
+
+        size_t i = 0;
+        while(i < n)
+        {
+            if(ptrs[i] == nullptr || (i > 0 && ptrs[i] == ptrs[i - 1]))
+            {
+                i++;
+                continue;
+            }
+
+            uint8_t kind = pagemapLookup(ptrs[i]);
+            if(kind == _CHUNK_RUN)
+            {
+                slabRouteFree(RUN_OF(ptrs[i]), ptrs[i]);
+                i++;
+            }
+            else if(kind >= _CHUNK_ARENA)
+            {
+                // The sorted pointers of the same arena that follow are freed together:
+                size_t end = i + 1;
+                while(end < n && pagemapLookup(ptrs[end]) == kind)
+                {
+                    end++;
+                }
+                arenas[kind - _CHUNK_ARENA].sfreeBatch(ptrs + i, end - i);
+                i = end;
+            }
+            else
+            {
+                std::lock_guard<std::mutex> guard(global_lock);
+                _sfreeMmapped(getMetaData(ptrs[i]));
+                i++;
+            }
+        }
+    }
+
+    void* srealloc(void* oldp, size_t size)
+    {
+        if(size == 0 || size > MAX_ALLOC_SIZE)
+        {
+            return NULL;
+        }
+        if(oldp == NULL)
+        {
+            return smalloc(size);
+        }
+
+        uint8_t kind = pagemapLookup(oldp);
+        if(kind == _CHUNK_RUN)
+        {
+            _SlabRun* run = RUN_OF(oldp);
+            // A slab object can not grow, so it is kept only if the new size still fits in its class:
+            if(ROUND_UP(size) <= run->size)
+            {
+                return oldp;
+            }
+            return reallocByCopy(oldp, run->size, size);
+        }
+
+        size_t requested = size;
+        size = ROUND_UP(size);
+        if(size < _MIN_PAYLOAD)
+        {
+            size = _MIN_PAYLOAD; // The block must be able to hold its tree links once it is freed.
+        }
+
+        size_t old_size;
+        if(kind >= _CHUNK_ARENA)
+        {
+            // A heap block that grows past the mmap threshold can not be merged or extended in place, it must be mmapped:
+            if(isMmappedSize(size))
+            {
+                return reallocByCopy(oldp, getMetaData(oldp)->size, requested);
+            }
+            void* newp = arenas[kind - _CHUNK_ARENA].srealloc(oldp, size, requested, &old_size);
+            if(newp)
+            {
+                return newp;
+            }
+        }
+        else
+        {
+            std::lock_guard<std::mutex> guard(global_lock);
+            _MallocMetaData* oldmeta = getMetaData(oldp);
+            old_size = oldmeta->size;
+            if(oldmeta->flags & _BLOCK_SAMPLED)
+            {
+                oldmeta->flags &= ~_BLOCK_SAMPLED;
+                _profileFree(oldp);
+            }
+            if(size == old_size)
+            {
+                return oldp;
+            }
+            if(isMmappedSize(size))
+            {
+                void* newp = _reallocMmapped(oldmeta, size);
+                if(newp)
+                {
+                    return newp;
+                }
+            }
+        }
+
+        // The block can not be resized where it is (the locks are not held anymore, since the copy takes them again):
+        return reallocByCopy(oldp, old_size, requested);
+    }
+    // $$$$$$$$$$ Main Funcs $$$$$$$$$$ //
+
+    // ********** Stats Getters ********** //
+    // Every object of a slab run is counted as a block, and the free objects as free blocks.
+    size_t getNumFreeBlocks() const
+    {
+        _HeapStats stats = arenaTotals();
+        std::lock_guard<std::mutex> guard(global_lock);
+        size_t cached_blocks, cached_bytes;
+        tcacheTotals(&cached_blocks, &cached_bytes);
+        return num_free_blocks + cached_blocks + stats.free_blocks;
+    }
+
+    size_t getNumFreeBytes() const
+    {
+        _HeapStats stats = arenaTotals();
+        std::lock_guard<std::mutex> guard(global_lock);
+        size_t cached_blocks, cached_bytes;
+        tcacheTotals(&cached_blocks, &cached_bytes);
+        return num_free_bytes + cached_bytes + stats.free_bytes;
+    }
+
+    size_t getNumAllocatedBlocks() const
+    {
+        _HeapStats stats = arenaTotals();
+        std::lock_guard<std::mutex> guard(global_lock);
+        return num_allocated_blocks + stats.allocated_blocks;
+    }
+
+    size_t getNumAllocatedBytes() const
+    {
+        _HeapStats stats = arenaTotals();
+        std::lock_guard<std::mutex> guard(global_lock);
+        return num_allocated_bytes + stats.allocated_bytes;
+    }
+
+    size_t getNumMetaDataBytes() const
+    {
+        _HeapStats stats = arenaTotals();
+        std::lock_guard<std::mutex> guard(global_lock);
+        return num_meta_data_bytes + stats.meta_data_bytes;
+    }
+
+    size_t getSizeMetaData() const
+    {
+        return size_meta_data;
+    }
+
+    size_t getNumTrimmedBytes() const
+    {
+        return arenaTotals().trimmed_bytes;
+    }
+
+    size_t getMmapThreshold() const
+    {
+        return mmap_threshold.load(std::memory_order_relaxed);
+    }
+
+    // The bytes the heaps were grown by, that are not part of any block yet (they are not counted as free).
+    size_t getNumReservedBytes() const
+    {
+        return arenaTotals().reserved_bytes;
+    }
+
+    size_t getNumMmapCacheHits() const
+    {
+        std::lock_guard<std::mutex> guard(global_lock);
+        return num_mmap_cache_hits;
+    }
+
+    size_t getNumMmapCacheMisses() const
+    {
+        std::lock_guard<std::mutex> guard(global_lock);
+        return num_mmap_cache_misses;
+    }
+
+    // The bytes of the mappings that are kept in the mmap cache (they are not counted as free or allocated).
+    size_t getNumMmapCachedBytes() const
+    {
+        std::lock_guard<std::mutex> guard(global_lock);
+        return mmap_cached_bytes;
+    }
+
+    size_t getNumReleasedBytes() const
+    {
+        return arenaTotals().released_bytes;
+    }
+
+    // The free bytes that still take physical memory, out of all the (virtual) free bytes.
+    size_t getNumResidentFreeBytes() const
+    {
+        _HeapStats stats = arenaTotals();
+        std::lock_guard<std::mutex> guard(global_lock);
+        size_t cached_blocks, cached_bytes;
+        tcacheTotals(&cached_blocks, &cached_bytes);
+        return num_free_bytes + cached_bytes + stats.free_bytes - stats.released_bytes;
+    }
+
+    // The bytes that are backed by huge pages: the mappings of huge mmapped blocks and the committed huge segments.
+    size_t getNumHugePageBytes() const
+    {
+        _HeapStats stats = arenaTotals();
+        std::lock_guard<std::mutex> guard(global_lock);
+        return num_huge_bytes + stats.huge_bytes;
+    }
+
+    size_t getNumArenas() const
+    {
+        return num_arenas;
+    }
+
+    // The statistics of the heap of a single arena (all zero for an index that is not an arena).
+    _HeapStats getArenaStats(size_t index) const
+    {
+        _HeapStats stats;
+        if(index < num_arenas)
+        {
+            arenas[index].addStats(&stats);
+        }
+        return stats;
+    }
+
+    // The fragmentation of the heaps of all the arenas. The largest free block is the largest of any arena.
+    _HeapFragmentation getFragmentation()
+    {
+        _HeapFragmentation fragmentation = { };
+        for(size_t i = 0; i < num_arenas; i++)
+        {
+            arenas[i].addFragmentation(&fragmentation);
+        }
+        fragmentation.external_fragmentation = fragmentation.free_bytes == 0? 0 :
+            1 - double(fragmentation.largest_free_block) / fragmentation.free_bytes;
+        return fragmentation;
+    }
+
+    // Walk the heaps of all the arenas, locking one arena at a time.
+    void walkHeap(_HeapWalk* walk)
+    {
+        memset(walk, 0, sizeof(*walk));
+        for(size_t i = 0; i < num_arenas; i++)
+        {
+            arenas[i].addWalk(walk);
+        }
+        walk->summary.external_fragmentation = walk->summary.free_bytes == 0? 0 :
+            1 - double(walk->summary.largest_free_block) / walk->summary.free_bytes;
+    }
+    // $$$$$$$$$$ Stat Getters $$$$$$$$$$ //
+
+    // ********** Tuning ********** //
+    // These apply to the heaps of all the arenas.
+    void setTrimThreshold(size_t threshold)
+    {
+        for(size_t i = 0; i < num_arenas; i++)
+        {
+            arenas[i].setTrimThreshold(threshold);
+        }
+    }
+
+    void setTopPad(size_t pad)
+    {
+        for(size_t i = 0; i < num_arenas; i++)
+        {
+            arenas[i].setTopPad(pad);
+        }
+    }
+
+    void setHeapGrowth(size_t chunk, size_t max_chunk)
+    {
+        for(size_t i = 0; i < num_arenas; i++)
+        {
+            arenas[i].setHeapGrowth(chunk, max_chunk);
+        }
+    }
+
+    // Back the mmapped blocks of at least a huge page, and the heap segments reserved from now on, with huge pages.
+    // Off by default, since a huge page is committed whole when it is first touched.
+    void setHugePages(bool enable)
+    {
+        {
+            std::lock_guard<std::mutex> guard(global_lock);
+            huge_pages = enable;
+        }
+        for(size_t i = 0; i < num_arenas; i++)
+        {
+            arenas[i].setHugePages(enable);
+        }
+    }
+
+    // Blocks larger than threshold are mmapped. Setting it stops the threshold from adapting.
+    void setMmapThreshold(size_t threshold)
+    {
+        std::lock_guard<std::mutex> guard(global_lock);
+        mmap_threshold = threshold;
+        mmap_threshold_fixed = true;
+    }
+
+    // The mmap cache holds at most limit bytes, and unmaps mappings that were cached for more than max_age milliseconds.
+    // A limit of 0 disables it.
+    void setMmapCacheLimit(size_t limit)
+    {
+        std::lock_guard<std::mutex> guard(global_lock);
+        mmap_cache_limit = limit;
+        mmapCacheEvict(0);
+    }
+
+    void setMmapCacheMaxAge(size_t max_age)
+    {
+        std::lock_guard<std::mutex> guard(global_lock);
+        mmap_cache_max_age = max_age;
+        mmapCacheEvict(0);
+    }
+    // $$$$$$$$$$ Tuning $$$$$$$$$$ //
+};
+
+// ********** Tracing ********** //
+// Records the calls of the user functions into a trace file (see smalloc_trace.h).
+// The callers reserve the slots of a ring buffer with an atomic counter and mark them as committed once written, and a
+// writer thread appends the committed records to the file in the order of their slots. So the callers never take a
+// lock; they only wait when the ring is full, until the writer catches up.
+class _Tracer
+{
+private:
+    _TraceRecord* ring;
+    std::atomic<uint8_t>* committed; // Per slot of the ring, whether its record is ready to be written.
+    std::atomic<uint64_t> reserved; // The number of records reserved so far.
+    std::atomic<uint64_t> drained; // The number of records written so far (or dropped, if the file failed).
+    std::atomic<size_t> active; // The callers that checked _tracing and did not commit their record yet.
+    std::atomic<bool> stopping;
+    int fd;
+    uint64_t start_time;
+    pthread_t writer;
+    bool at_exit_set;
+    std::mutex control_lock; // Serializes starting and stopping the trace.
+
+    _Tracer() : ring(nullptr), committed(nullptr), reserved(0), drained(0), active(0), stopping(false), fd(-1),
+    start_time(0), writer(), at_exit_set(false)
+    {
+    }
+
+    static uint64_t now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    void writeAll(const void* buf, size_t length)
+    {
+        const char* p = static_cast<const char*>(buf);
+        while(length > 0)
+        {
+            ssize_t written = write(fd, p, length);
+            if(written <= 0)
+            {
+                if(written < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                return; // The rest of the trace is lost, but the callers must not be held up by it.
+            }
+            p += written;
+            length -= written;
+        }
+    }
 
-                _MallocMetaData* splitted = split(new_block, size);
-                if(splitted)
+    // The writer thread: write the committed records in order, until the trace is stopped and all of them are written.
+    static void* writerMain(void* arg)
+    {
+        _Tracer* tracer = static_cast<_Tracer*>(arg);
+        while(true)
+        {
+            uint64_t begin = tracer->drained.load(std::memory_order_relaxed);
+            uint64_t end = begin;
+            while(end - begin < _TRACE_RING_SIZE &&
+                tracer->committed[end & (_TRACE_RING_SIZE - 1)].load(std::memory_order_acquire))
+            {
+                end++;
+            }
+            if(end == begin)
+            {
+                if(tracer->stopping.load(std::memory_order_acquire) &&
+                    tracer->reserved.load(std::memory_order_acquire) == begin)
                 {
-                    // Update statistics:
-                    num_free_blocks++;
-                    num_free_bytes += splitted->size;
-                    num_allocated_blocks++;
-                    num_meta_data_bytes += _METADATA_SIZE;
-                    num_allocated_bytes -= _METADATA_SIZE;
+                    return nullptr;
                 }
-                return getPayload(new_block);
+                timespec sleep = { 0, _TRACE_WRITER_SLEEP };
+                nanosleep(&sleep, nullptr);
+                continue;
+            }
+
+            // The records may wrap around the end of the ring:
+            size_t first = begin & (_TRACE_RING_SIZE - 1);
+            size_t count = end - begin;
+            size_t until_wrap = _TRACE_RING_SIZE - first < count? _TRACE_RING_SIZE - first : count;
+            tracer->writeAll(tracer->ring + first, until_wrap * sizeof(_TraceRecord));
+            tracer->writeAll(tracer->ring, (count - until_wrap) * sizeof(_TraceRecord));
+            for(uint64_t i = begin; i < end; i++)
+            {
+                tracer->committed[i & (_TRACE_RING_SIZE - 1)].store(0, std::memory_order_relaxed);
+            }
+            tracer->drained.store(end, std::memory_order_release);
+        }
+    }
+
+    // A forked child has no writer thread, so it must not trace (and it must not wait for the writer either).
+    static void forkChild()
+    {
+        _Tracer& instance = getInstance();
+        _tracing.store(false, std::memory_order_relaxed);
+        instance.active.store(0, std::memory_order_relaxed);
+        if(instance.fd >= 0)
+        {
+            close(instance.fd);
+            instance.fd = -1;
+        }
+    }
+
+    static void stopAtExit()
+    {
+        getInstance().stop();
+    }
+
+    // Assumes that control_lock is held.
+    void _stop()
+    {
+        if(fd < 0)
+        {
+            return;
+        }
+        _tracing.store(false);
+        while(active.load() != 0)
+        {
+            sched_yield();
+        }
+        stopping.store(true, std::memory_order_release);
+        pthread_join(writer, nullptr);
+        close(fd);
+        fd = -1;
+        munmap(ring, _TRACE_RING_SIZE * sizeof(_TraceRecord));
+        munmap(committed, _TRACE_RING_SIZE);
+    }
+
+public:
+    static _Tracer& getInstance()    // make _Tracer singleton
+    {
+        static _Tracer instance;
+        return instance;
+    }
+
+    _Tracer(_Tracer& other) = delete; // disable copy ctor
+    void operator=(_Tracer const &) = delete; // disable = operator
+
+    // Start a trace into the file at path, stopping the current one first.
+    bool start(const char* path)
+    {
+        std::lock_guard<std::mutex> guard(control_lock);
+        _stop();
+
+        int file = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(file < 0)
+        {
+            return false;
+        }
+        void* ring_mem = mmap(NULL, _TRACE_RING_SIZE * sizeof(_TraceRecord), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void* committed_mem = mmap(NULL, _TRACE_RING_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ring_mem == MAP_FAILED || committed_mem == MAP_FAILED)
+        {
+            if(ring_mem != MAP_FAILED)
+            {
+                munmap(ring_mem, _TRACE_RING_SIZE * sizeof(_TraceRecord));
+            }
+            if(committed_mem != MAP_FAILED)
+            {
+                munmap(committed_mem, _TRACE_RING_SIZE);
+            }
+            close(file);
+            return false;
+        }
+        fd = file;
+        ring = static_cast<_TraceRecord*>(ring_mem);
+        committed = static_cast<std::atomic<uint8_t>*>(committed_mem); // (Zeroed mappings are valid atomics)
+        reserved.store(0, std::memory_order_relaxed);
+        drained.store(0, std::memory_order_relaxed);
+        stopping.store(false, std::memory_order_relaxed);
+
+        _TraceHeader header = { };
+        memcpy(header.magic, _TRACE_MAGIC, sizeof(_TRACE_MAGIC));
+        header.version = _TRACE_VERSION;
+        header.record_size = sizeof(_TraceRecord);
+        writeAll(&header, sizeof(header));
+
+        if(pthread_create(&writer, nullptr, writerMain, this) != 0)
+        {
+            close(fd);
+            fd = -1;
+            munmap(ring, _TRACE_RING_SIZE * sizeof(_TraceRecord));
+            munmap(committed, _TRACE_RING_SIZE);
+            return false;
+        }
+        if(!at_exit_set)
+        {
+            at_exit_set = true;
+            atexit(stopAtExit);
+            pthread_atfork(nullptr, nullptr, forkChild);
+        }
+        start_time = now();
+        _tracing.store(true);
+        return true;
+    }
+
+    void stop()
+    {
+        std::lock_guard<std::mutex> guard(control_lock);
+        _stop();
+    }
+
+    void record(uint32_t op, void* p, void* oldp, size_t size)
+    {
+        active.fetch_add(1);
+        if(!_tracing.load()) // Checked again, now that stop() waits for this call.
+        {
+            active.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+        uint64_t slot = reserved.fetch_add(1, std::memory_order_relaxed);
+        while(slot - drained.load(std::memory_order_acquire) >= _TRACE_RING_SIZE)
+        {
+            sched_yield();
+        }
+
+        _TraceRecord* record = ring + (slot & (_TRACE_RING_SIZE - 1));
+        record->time = now() - start_time;
+        record->ptr = reinterpret_cast<uint64_t>(p);
+        record->old_ptr = reinterpret_cast<uint64_t>(oldp);
+        record->size = size;
+        record->op = op;
+        committed[slot & (_TRACE_RING_SIZE - 1)].store(1, std::memory_order_release);
+        active.fetch_sub(1, std::memory_order_release);
+    }
+};
+
+// Record a call, if tracing is on.
+// Allocations are recorded after the call and frees before it, so a record never comes before the record of the block
+// it reuses. (A srealloc() that moves its block can still race with a thread that gets the old block)
+static inline void _trace(uint32_t op, void* p, void* oldp, size_t size)
+{
+    if(_tracing.load(std::memory_order_relaxed))
+    {
+        _Tracer::getInstance().record(op, p, oldp, size);
+    }
+}
+// $$$$$$$$$$ Tracing $$$$$$$$$$ //
+
+// ********** Heap Profiling ********** //
+// Samples about one allocation per _sample_period bytes, like tcmalloc: every thread counts down the bytes it allocates
+// from a random (exponentially distributed) number, and the allocation that crosses zero is sampled. Its block is
+// marked with _BLOCK_SAMPLED and its call stack is recorded in the bucket of that stack, so the frees only look at the
+// flags of the blocks they already hold under a lock. The records of the profiler are mapped with mmap(), so it never
+// calls the allocator (which calls it while holding its locks).
+class _HeapProfiler
+{
+private:
+    _ProfileBucket* buckets[_PROFILE_TABLE_SIZE]; // By the hash of their stack.
+    _ProfileSample* samples[_PROFILE_TABLE_SIZE]; // By the address of their block.
+    _ProfileSample* free_samples;
+    size_t num_buckets;
+    char* chunk; // The rest of the mapping the records are carved from.
+    size_t chunk_left;
+    std::mutex lock;
+
+    _HeapProfiler() : buckets(), samples(), free_samples(nullptr), num_buckets(0), chunk(nullptr), chunk_left(0)
+    {
+    }
+
+    static size_t addressHash(void* p)
+    {
+        return (reinterpret_cast<uintptr_t>(p) >> 4) & (_PROFILE_TABLE_SIZE - 1);
+    }
+
+    // Assumes that lock is held.
+    void* carve(size_t bytes)
+    {
+        bytes = ROUND_UP(bytes);
+        if(bytes > chunk_left)
+        {
+            void* mapping = mmap(NULL, _PROFILE_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(mapping == MAP_FAILED)
+            {
+                return nullptr;
+            }
+            chunk = static_cast<char*>(mapping);
+            chunk_left = _PROFILE_CHUNK;
+        }
+        void* p = chunk;
+        chunk += bytes;
+        chunk_left -= bytes;
+        return p;
+    }
+
+    // Find the bucket of a stack, or add it. Assumes that lock is held.
+    _ProfileBucket* getBucket(void** stack, size_t depth)
+    {
+        uint64_t hash = 14695981039346656037ULL; // FNV-1a, over the addresses.
+        for(size_t i = 0; i < depth; i++)
+        {
+            hash = (hash ^ reinterpret_cast<uintptr_t>(stack[i])) * 1099511628211ULL;
+        }
+        _ProfileBucket** list = &buckets[hash & (_PROFILE_TABLE_SIZE - 1)];
+        for(_ProfileBucket* bucket = *list; bucket; bucket = bucket->next)
+        {
+            if(bucket->hash == hash && bucket->depth == depth && memcmp(bucket->stack, stack, depth * sizeof(void*)) == 0)
+            {
+                return bucket;
+            }
+        }
+
+        _ProfileBucket* bucket = static_cast<_ProfileBucket*>(carve(sizeof(_ProfileBucket)));
+        if(bucket == nullptr)
+        {
+            return nullptr;
+        }
+        memset(bucket, 0, sizeof(_ProfileBucket));
+        bucket->hash = hash;
+        bucket->depth = depth;
+        memcpy(bucket->stack, stack, depth * sizeof(void*));
+        bucket->next = *list;
+        *list = bucket;
+        num_buckets++;
+        return bucket;
+    }
+
+    // Assumes that lock is held.
+    void _remove(void* p)
+    {
+        for(_ProfileSample** link = &samples[addressHash(p)]; *link; link = &(*link)->next)
+        {
+            _ProfileSample* sample = *link;
+            if(sample->p == p)
+            {
+                sample->bucket->free_count++;
+                sample->bucket->free_bytes += sample->size;
+                *link = sample->next;
+                sample->next = free_samples;
+                free_samples = sample;
+                return;
             }
+        }
+    }
 
-            // C: Try to merge with the adjacent block wit hthe HIGHER address:
-            else if(oldmeta->next && oldmeta->next->is_free && (oldmeta->size + oldmeta->next->size + _METADATA_SIZE >= size))
-            {
-                // We can merge the right block with our block.
-                _MallocMetaData* new_block = nullptr;
+public:
+    static _HeapProfiler& getInstance()    // make _HeapProfiler singleton
+    {
+        static _HeapProfiler instance;
+        return instance;
+    }
 
-                // Update statistics:
-                num_meta_data_bytes -= _METADATA_SIZE;
-                num_allocated_bytes += _METADATA_SIZE;
-                num_free_bytes -= oldmeta->next->size;
-                num_free_blocks--;
-                num_allocated_blocks--;
-                
-                histRemove(oldmeta->next);
-                _mergeToNext(oldmeta, &new_block, false);
+    _HeapProfiler(_HeapProfiler& other) = delete; // disable copy ctor
+    void operator=(_HeapProfiler const &) = delete; // disable = operator
 
-                _MallocMetaData* splitted = split(new_block, size);
-                if(splitted)
-                {
-                    // Update statistics:
-                    num_free_blocks++;
-                    num_free_bytes += splitted->size;
-                    num_allocated_blocks++;
-                    num_meta_data_bytes += _METADATA_SIZE;
-                    num_allocated_bytes -= _METADATA_SIZE;
-                }
-                return getPayload(new_block);
-            }
+    void lockProfile()
+    {
+        lock.lock();
+    }
 
-            // D: Try to merge all those THREE adjacent blocks together:
-            else if(oldmeta->prev && oldmeta->next && \
-            oldmeta->prev->is_free && oldmeta->next->is_free && \
-            (oldmeta->size + oldmeta->prev->size + oldmeta->next->size + 2 * _METADATA_SIZE >= size))
-            {
-                // We can merge the left block with our block.
-                _MallocMetaData* new_block = nullptr;
+    void unlockProfile()
+    {
+        lock.unlock();
+    }
 
-                // Update statistics:
-                num_meta_data_bytes -= 2 * _METADATA_SIZE;
-                num_allocated_bytes += 2 * _METADATA_SIZE;
-                num_free_bytes -= (oldmeta->prev->size + oldmeta->next->size);
-                num_free_blocks -= 2;
-                num_allocated_blocks -= 2;
-                
-                _mergeToSurrounding(oldmeta, &new_block, false);
-
-                _MallocMetaData* splitted = split(new_block, size);
-                if(splitted)
+    // Record a sampled allocation of size bytes at p, whose block is marked as sampled.
+    void record(void* p, size_t size, void** stack, size_t depth)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        _remove(p); // (A block that is resized in place may be sampled again)
+        _ProfileBucket* bucket = getBucket(stack, depth);
+        _ProfileSample* sample = free_samples;
+        if(sample)
+        {
+            free_samples = sample->next;
+        }
+        else
+        {
+            sample = static_cast<_ProfileSample*>(carve(sizeof(_ProfileSample)));
+        }
+        if(bucket == nullptr || sample == nullptr)
+        {
+            return; // The profile misses this sample (its block stays marked, which is harmless).
+        }
+        sample->p = p;
+        sample->size = size;
+        sample->bucket = bucket;
+        sample->next = samples[addressHash(p)];
+        samples[addressHash(p)] = sample;
+
+        // Update statistics:
+        bucket->alloc_count++;
+        bucket->alloc_bytes += size;
+    }
+
+    // Forget the sample of the block at p, which is freed.
+    void remove(void* p)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        _remove(p);
+    }
+
+    /**
+     * Write the profile to the file at path (truncated), in the heap profile format of gperftools that pprof reads:
+     * a line per call stack with the sampled allocations that are still live and their bytes, then all of those that
+     * were sampled and their bytes (so pprof shows the live heap with -inuse_space and the cumulative allocations with
+     * -alloc_space), then the mappings of the process, to symbolize the stacks.
+     * The counts are of the samples; pprof scales them by the sample period in the header.
+     * Return false if the file could not be written.
+     */
+    bool dump(const char* path, size_t period)
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0)
+        {
+            return false;
+        }
+
+        // The lines are formatted under the lock into a mapping, and written after it is released:
+        lock.lock();
+        size_t length = (num_buckets + 1) * _PROFILE_LINE_SIZE;
+        void* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mapping == MAP_FAILED)
+        {
+            lock.unlock();
+            close(fd);
+            return false;
+        }
+        char* text = static_cast<char*>(mapping);
+        size_t used = _PROFILE_LINE_SIZE; // The header goes first, once the totals are known.
+        size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+        for(size_t i = 0; i < _PROFILE_TABLE_SIZE; i++)
+        {
+            for(_ProfileBucket* bucket = buckets[i]; bucket; bucket = bucket->next)
+            {
+                char* line = text + used;
+                int n = snprintf(line, _PROFILE_LINE_SIZE, "%zu: %zu [%zu: %zu] @", bucket->alloc_count - bucket->free_count,
+                    bucket->alloc_bytes - bucket->free_bytes, bucket->alloc_count, bucket->alloc_bytes);
+                for(size_t frame = 0; frame < bucket->depth; frame++)
                 {
-                    // Update statistics:
-                    num_free_blocks++;
-                    num_free_bytes += splitted->size;
-                    num_allocated_blocks++;
-                    num_meta_data_bytes += _METADATA_SIZE;
-                    num_allocated_bytes -= _METADATA_SIZE;
+                    n += snprintf(line + n, _PROFILE_LINE_SIZE - n, " %p", bucket->stack[frame]);
                 }
-                // Copy the data to the new address:
-                memmove(getPayload(new_block), oldp, old_size);
-                return getPayload(new_block);
-            }
+                line[n++] = '\n';
+                used += n;
 
-            // A-D Failed, so check if we are trying to realloc wilderness, and extend it if so.
-            if(oldmeta == wilderness)
-            {
-                return getPayload(_extendWilderness(size));
+                live_count += bucket->alloc_count - bucket->free_count;
+                live_bytes += bucket->alloc_bytes - bucket->free_bytes;
+                alloc_count += bucket->alloc_count;
+                alloc_bytes += bucket->alloc_bytes;
             }
+        }
+        lock.unlock();
 
-            // Otherwise, call smalloc:
-            void* ptr = smalloc(size);
-            if(!ptr)
+        char header[_PROFILE_LINE_SIZE];
+        int header_length = snprintf(header, sizeof(header), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            live_count, live_bytes, alloc_count, alloc_bytes, period);
+        bool ok = writeAll(fd, header, header_length) && writeAll(fd, text + _PROFILE_LINE_SIZE, used - _PROFILE_LINE_SIZE);
+        munmap(mapping, length);
+
+        static const char maps_title[] = "\nMAPPED_LIBRARIES:\n";
+        ok = ok && writeAll(fd, maps_title, sizeof(maps_title) - 1);
+        int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+        if(maps >= 0)
+        {
+            char buf[4096];
+            ssize_t got;
+            while(ok && (got = read(maps, buf, sizeof(buf))) > 0)
             {
-                return nullptr;
+                ok = writeAll(fd, buf, got);
             }
-
-            memmove(ptr, oldp, size >= oldmeta->size? oldmeta->size : size);
-            sfree(oldp);
-            return ptr;
+            close(maps);
         }
-        else
+        return close(fd) == 0 && ok;
+    }
+
+    static bool writeAll(int fd, const char* p, size_t length)
+    {
+        while(length > 0)
         {
-            if(size == old_size)
+            ssize_t written = write(fd, p, length);
+            if(written <= 0)
             {
-                return oldp;
+                if(written < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
             }
-            void* newp = smalloc(size);
-            memmove(newp, oldp, old_size > size? size : old_size);
-            sfree(oldp);
-            return newp;
+            p += written;
+            length -= written;
         }
+        return true;
     }
-    // $$$$$$$$$$ Main Funcs $$$$$$$$$$ //
+};
 
-    // ********** Stats Getters ********** //
-    size_t getNumFreeBlocks() const
+// The mean number of bytes between samples, 0 while the profiler is off.
+static std::atomic<size_t> _sample_period(0);
+
+// The bytes the calling thread allocates until its next sample, and the period they were drawn for.
+static thread_local int64_t _tsample_countdown = 0;
+static thread_local size_t _tsample_period = 0;
+static thread_local uint64_t _tsample_seed = 0;
+
+static void _profileFree(void* p)
+{
+    _HeapProfiler::getInstance().remove(p);
+}
+
+static void _profileForkLock()
+{
+    _HeapProfiler::getInstance().lockProfile();
+}
+
+static void _profileForkUnlock()
+{
+    _HeapProfiler::getInstance().unlockProfile();
+}
+
+// Called when the countdown of the thread crosses zero: draw the next one, and return whether to sample the allocation.
+// The countdowns are exponentially distributed, so that the samples are a Poisson process over the allocated bytes.
+static bool _sampleNext()
+{
+    size_t period = _sample_period.load(std::memory_order_relaxed);
+    if(period == 0)
+    {
+        _tsample_countdown = _SAMPLE_RECHECK;
+        _tsample_period = 0;
+        return false;
+    }
+    if(_tsample_seed == 0)
     {
-        return num_free_blocks;
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        _tsample_seed = (reinterpret_cast<uintptr_t>(&_tsample_seed) ^ uint64_t(ts.tv_nsec)) | 1;
     }
+    _tsample_seed ^= _tsample_seed >> 12; // xorshift64*
+    _tsample_seed ^= _tsample_seed << 25;
+    _tsample_seed ^= _tsample_seed >> 27;
+    double uniform = double(((_tsample_seed * 2685821657736338717ULL) >> 11) + 1) / double(1ULL << 53); // In (0, 1].
+    _tsample_countdown = int64_t(-std::log(uniform) * period) + 1;
 
-    size_t getNumFreeBytes() const
+    // A countdown that was drawn for another period (or while the profiler was off) only starts the new one:
+    bool sample = (_tsample_period == period);
+    _tsample_period = period;
+    return sample;
+}
+
+// Count an allocation of size bytes down, and return whether it is sampled. This is all unsampled calls pay.
+static inline bool _shouldSample(size_t size)
+{
+    _tsample_countdown -= int64_t(size);
+    return _tsample_countdown < 0 && _sampleNext();
+}
+
+// Record the call stack of a sampled allocation. The frames of this function and of the user function are skipped.
+__attribute__((noinline)) static void _profileAllocation(void* p, size_t size)
+{
+    void* stack[_PROFILE_MAX_DEPTH + 2];
+    int depth = backtrace(stack, _PROFILE_MAX_DEPTH + 2);
+    if(depth > 2)
     {
-        return num_free_bytes;
+        _HeapProfiler::getInstance().record(p, size, stack + 2, depth - 2);
     }
+}
+// $$$$$$$$$$ Heap Profiling $$$$$$$$$$ //
 
-    size_t getNumAllocatedBlocks() const
+// ********** The User Functions ********** //
+void* smalloc(size_t size)
+{
+    _LATENCY_START(start);
+    void* p;
+    if(_shouldSample(size))
+    {
+        p = _AllocList::getInstance().smallocSampled(size);
+        if(p)
+        {
+            _profileAllocation(p, size);
+        }
+    }
+    else
+    {
+        p = _AllocList::getInstance().smalloc(size);
+    }
+    _LATENCY_END(_OP_SMALLOC, start);
+    if(p)
     {
-        return num_allocated_blocks;
+        _trace(_TRACE_MALLOC, p, nullptr, size);
     }
+    return p;
+}
 
-    size_t getNumAllocatedBytes() const
+void* scalloc(size_t num, size_t size)
+{
+    size_t total;
+    if(__builtin_mul_overflow(num, size, &total))
     {
-        return num_allocated_bytes;
+        return NULL;
     }
+    bool sampled = _shouldSample(total);
+    void* p = _AllocList::getInstance().scalloc(total, sampled);
+    if(p)
+    {
+        if(sampled)
+        {
+            _profileAllocation(p, total);
+        }
+        _trace(_TRACE_CALLOC, p, nullptr, total);
+    }
+    return p;
+}
 
-    size_t getNumMetaDataBytes() const
+void* sfree(void* p)
+{
+    if(p)
     {
-        return num_meta_data_bytes;
+        _trace(_TRACE_FREE, p, nullptr, 0);
     }
+    _LATENCY_START(start);
+    _AllocList::getInstance().sfree(p);
+    _LATENCY_END(_OP_SFREE, start);
+    return nullptr;
+}
 
-    size_t getSizeMetaData() const
+void* srealloc(void* oldp, size_t size)
+{
+    _LATENCY_START(start);
+    void* p = _AllocList::getInstance().srealloc(oldp, size);
+    _LATENCY_END(_OP_SREALLOC, start);
+    if(p)
     {
-        return size_meta_data;
+        // (The sample is dropped if the block is a slab object, which can not be marked)
+        if(_shouldSample(size) && _AllocList::getInstance().markSampled(p))
+        {
+            _profileAllocation(p, size);
+        }
+        _trace(oldp? _TRACE_REALLOC : _TRACE_MALLOC, p, oldp, size);
     }
-    // $$$$$$$$$$ Stat Getters $$$$$$$$$$ //
-};
+    return p;
+}
 
-// ********** The User Functions ********** //
-void* smalloc(size_t size)
+void sfree_sized(void* p, size_t size)
 {
-    return _AllocList::getInstance().smalloc(size);
+    if(p)
+    {
+        _trace(_TRACE_FREE, p, nullptr, 0);
+    }
+    _AllocList::getInstance().sfreeSized(p, size);
 }
 
-void* scalloc(size_t num, size_t size)
+size_t smalloc_usable_size(void* p)
 {
-    return _AllocList::getInstance().scalloc(num, size);
+    return _AllocList::getInstance().usableSize(p);
 }
 
-void* sfree(void* p)
+size_t smalloc_batch(size_t size, size_t n, void** out)
 {
-    _AllocList::getInstance().sfree(p);
+    size_t done = _AllocList::getInstance().smallocBatch(size, n, out);
+    for(size_t i = 0; i < done && _tracing.load(std::memory_order_relaxed); i++)
+    {
+        _trace(_TRACE_MALLOC, out[i], nullptr, size);
+    }
+    return done;
 }
 
-void* srealloc(void* oldp, size_t size)
+void sfree_batch(void** ptrs, size_t n)
+{
+    for(size_t i = 0; i < n && _tracing.load(std::memory_order_relaxed); i++)
+    {
+        if(ptrs[i])
+        {
+            _trace(_TRACE_FREE, ptrs[i], nullptr, 0);
+        }
+    }
+    _AllocList::getInstance().sfreeBatch(ptrs, n);
+}
+
+void* smemalign(size_t alignment, size_t size)
+{
+    void* p = _AllocList::getInstance().smemalign(alignment, size);
+    if(p)
+    {
+        _trace(_TRACE_MEMALIGN, p, reinterpret_cast<void*>(alignment), size);
+    }
+    return p;
+}
+
+void* saligned_alloc(size_t alignment, size_t size)
+{
+    return smemalign(alignment, size);
+}
+
+int sposix_memalign(void** memptr, size_t alignment, size_t size)
 {
-    return _AllocList::getInstance().srealloc(oldp, size);
+    if(alignment < sizeof(void*) || (alignment & (alignment - 1)))
+    {
+        return EINVAL;
+    }
+    if(size == 0)
+    {
+        *memptr = NULL;
+        return 0;
+    }
+    void* p = smemalign(alignment, size);
+    if(p == NULL)
+    {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
 }
 // $$$$$$$$$$ The User Functions $$$$$$$$$$ //
 
@@ -913,4 +4249,183 @@ size_t _size_meta_data()
 {
     return _AllocList::getInstance().getSizeMetaData();
 }
+
+size_t _num_trimmed_bytes() 
+{
+    return _AllocList::getInstance().getNumTrimmedBytes();
+}
+
+size_t _num_released_bytes() 
+{
+    return _AllocList::getInstance().getNumReleasedBytes();
+}
+
+size_t _num_resident_free_bytes() 
+{
+    return _AllocList::getInstance().getNumResidentFreeBytes();
+}
+
+size_t _num_reserved_bytes() 
+{
+    return _AllocList::getInstance().getNumReservedBytes();
+}
+
+size_t _num_huge_page_bytes() 
+{
+    return _AllocList::getInstance().getNumHugePageBytes();
+}
+
+size_t _num_arenas() 
+{
+    return _AllocList::getInstance().getNumArenas();
+}
+
+size_t _arena_num_free_blocks(size_t arena) 
+{
+    return _AllocList::getInstance().getArenaStats(arena).free_blocks;
+}
+
+size_t _arena_num_free_bytes(size_t arena) 
+{
+    return _AllocList::getInstance().getArenaStats(arena).free_bytes;
+}
+
+size_t _arena_num_allocated_blocks(size_t arena) 
+{
+    return _AllocList::getInstance().getArenaStats(arena).allocated_blocks;
+}
+
+size_t _arena_num_allocated_bytes(size_t arena) 
+{
+    return _AllocList::getInstance().getArenaStats(arena).allocated_bytes;
+}
+
+size_t _mmap_threshold() 
+{
+    return _AllocList::getInstance().getMmapThreshold();
+}
+
+size_t _num_mmap_cache_hits() 
+{
+    return _AllocList::getInstance().getNumMmapCacheHits();
+}
+
+size_t _num_mmap_cache_misses() 
+{
+    return _AllocList::getInstance().getNumMmapCacheMisses();
+}
+
+size_t _num_mmap_cached_bytes() 
+{
+    return _AllocList::getInstance().getNumMmapCachedBytes();
+}
+
+void _set_trim_threshold(size_t threshold)
+{
+    _AllocList::getInstance().setTrimThreshold(threshold);
+}
+
+void _set_top_pad(size_t pad)
+{
+    _AllocList::getInstance().setTopPad(pad);
+}
+
+void _set_heap_growth(size_t chunk, size_t max_chunk)
+{
+    _AllocList::getInstance().setHeapGrowth(chunk, max_chunk);
+}
+
+void _set_huge_pages(bool enable)
+{
+    _AllocList::getInstance().setHugePages(enable);
+}
+
+void _set_mmap_threshold(size_t threshold)
+{
+    _AllocList::getInstance().setMmapThreshold(threshold);
+}
+
+void _set_mmap_cache_limit(size_t limit)
+{
+    _AllocList::getInstance().setMmapCacheLimit(limit);
+}
+
+void _set_mmap_cache_max_age(size_t max_age)
+{
+    _AllocList::getInstance().setMmapCacheMaxAge(max_age);
+}
+
+bool _instrument_snapshot(_InstrumentSnapshot* snapshot)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+#ifdef SMALLOC_INSTRUMENT
+    for(size_t i = 0; i < _INSTRUMENT_STRIPES; i++)
+    {
+        for(size_t path = 0; path < _PATH_COUNT; path++)
+        {
+            snapshot->paths[path] += _instrument[i].paths[path].load(std::memory_order_relaxed);
+        }
+        for(size_t op = 0; op < _OP_COUNT; op++)
+        {
+            for(size_t bucket = 0; bucket < _LATENCY_BUCKETS; bucket++)
+            {
+                snapshot->latency[op][bucket] += _instrument[i].latency[op][bucket].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void _instrument_reset()
+{
+#ifdef SMALLOC_INSTRUMENT
+    for(size_t i = 0; i < _INSTRUMENT_STRIPES; i++)
+    {
+        for(size_t path = 0; path < _PATH_COUNT; path++)
+        {
+            _instrument[i].paths[path].store(0, std::memory_order_relaxed);
+        }
+        for(size_t op = 0; op < _OP_COUNT; op++)
+        {
+            for(size_t bucket = 0; bucket < _LATENCY_BUCKETS; bucket++)
+            {
+                _instrument[i].latency[op][bucket].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+#endif
+}
+
+void _set_sample_period(size_t period)
+{
+    _sample_period.store(period, std::memory_order_relaxed);
+}
+
+bool _dump_heap_profile(const char* path)
+{
+    return _HeapProfiler::getInstance().dump(path, _sample_period.load(std::memory_order_relaxed));
+}
+
+void _heap_fragmentation(_HeapFragmentation* fragmentation)
+{
+    *fragmentation = _AllocList::getInstance().getFragmentation();
+}
+
+void _heap_walk(_HeapWalk* walk)
+{
+    _AllocList::getInstance().walkHeap(walk);
+}
+
+bool _set_trace_file(const char* path)
+{
+    if(path == NULL)
+    {
+        _Tracer::getInstance().stop();
+        return true;
+    }
+    return _Tracer::getInstance().start(path);
+}
 // $$$$$ Statistics private functions: $$$$$ //
\ No newline at end of file
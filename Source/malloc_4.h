@@ -0,0 +1,40 @@
+#ifndef _MALLOC_4_H
+#define _MALLOC_4_H
+// Everything malloc_4.cpp includes, and the constants it shares with the code around it.
+// The benchmark includes this header at global scope before it wraps malloc_4.cpp in a namespace, so the includes of
+// malloc_4.cpp must all be made here.
+#include <unistd.h>
+#include <cstring>
+#include <cassert>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <cstdint>
+#include <time.h>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <cstdlib>
+#include <sched.h>
+#include <cmath>
+#include <execinfo.h>
+#include "smalloc_trace.h"
+#include "smalloc_instrument.h"
+#include "smalloc_profile.h"
+#include "smalloc_heap.h"
+#if defined(SMALLOC_INSTRUMENT) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+// The size classes of the per-thread caches. A slab run starts at a multiple of 16 and its header takes a multiple of
+// 16 bytes, so the slab objects of a size that is a multiple of 16 are aligned to 16.
+#define _TCACHE_MAX_SIZE 512 // The largest (rounded up) size that is served by the per-thread caches from slab runs.
+#define _TCACHE_CLASSES (_TCACHE_MAX_SIZE/8) // = 64 size classes, 8 bytes apart.
+
+// The larger blocks are heap blocks, aligned to 8, up to the mmap threshold. Above it, they are mmapped blocks, whose
+// payload starts 32 bytes into a mapping.
+#define _MAX_ALLOC 131071 // = 128KB, the initial maximum allocatable size on the heap of an arena (the mmap threshold).
+
+#endif
\ No newline at end of file
@@ -0,0 +1,427 @@
+// A drop-in replacement of the libc allocator with the one of malloc_4, to be loaded with LD_PRELOAD:
+//
+//     g++ -std=c++17 -O2 -fPIC -shared -ftls-model=initial-exec -pthread -o libsmalloc.so malloc_4.cpp malloc_4_preload.cpp
+//     LD_PRELOAD=./libsmalloc.so <program>
+//
+// Nothing is forwarded to the libc allocator (so dlsym() is never needed), but the allocator may be called before the
+// static initializers have run, and the first call constructs it, which may allocate again (pthread_atfork() and
+// atexit() do so in some libc versions). Such calls, and any other call made from inside the allocator, are served from
+// a small static bootstrap buffer whose blocks are never reused.
+// Note that, like smalloc(), the shim fails requests of more than MAX_ALLOC_SIZE (100MB) bytes.
+// If SMALLOC_TRACE is set, the calls of the program are traced into the file it names (see smalloc_trace.h).
+// If SMALLOC_HEAP_PROFILE is set, the allocations are sampled (one per SMALLOC_SAMPLE_PERIOD bytes, 512KB by default)
+// and the heap profile is written at exit into the file it names (see smalloc_profile.h).
+#include "malloc_4.h"
+#include "smalloc.h"
+#include "smalloc_trace.h"
+#include "smalloc_profile.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+
+#define _BOOTSTRAP_SIZE (64 * 1024)
+#define _BOOTSTRAP_HEADER 16 // The size of a bootstrap block is kept right before its payload.
+#define _MIN_ALIGNMENT 16 // The alignment of max_align_t, which malloc() owes to any object that may need it.
+#define _SHIM_PAGE_SIZE 4096
+#define _DEFAULT_SAMPLE_PERIOD (512 * 1024)
+
+// The states of the allocator, as seen by the shim:
+#define _SHIM_UNINITIALIZED 0
+#define _SHIM_INITIALIZING 1 // The first call is constructing the allocator, the others use the bootstrap buffer meanwhile.
+#define _SHIM_READY 2
+
+alignas(_MIN_ALIGNMENT) static char _bootstrap_heap[_BOOTSTRAP_SIZE];
+static std::atomic<size_t> _bootstrap_used(0);
+static std::atomic<int> _shim_state(_SHIM_UNINITIALIZED);
+static thread_local int _shim_depth __attribute__((tls_model("initial-exec"))) = 0; // Nesting of the shim's calls in this thread.
+
+// ********** Bootstrap Buffer ********** //
+static bool _isBootstrap(void* p)
+{
+    return p >= _bootstrap_heap && p < _bootstrap_heap + _BOOTSTRAP_SIZE;
+}
+
+// Carve size bytes aligned to alignment (a power of 2) off the buffer. The buffer starts zeroed and is never reused,
+// so the blocks are zeroed as well.
+static void* _bootstrapAlloc(size_t alignment, size_t size)
+{
+    if(alignment < _MIN_ALIGNMENT)
+    {
+        alignment = _MIN_ALIGNMENT;
+    }
+    uintptr_t base = reinterpret_cast<uintptr_t>(_bootstrap_heap);
+    size_t used = _bootstrap_used.load(std::memory_order_relaxed);
+    size_t start, end;
+    do
+    {
+        start = ((base + used + _BOOTSTRAP_HEADER + alignment - 1) & ~(alignment - 1)) - base;
+        end = start + ((size + _MIN_ALIGNMENT - 1) & ~(size_t)(_MIN_ALIGNMENT - 1));
+        if(size > _BOOTSTRAP_SIZE || alignment > _BOOTSTRAP_SIZE || end > _BOOTSTRAP_SIZE)
+        {
+            return nullptr;
+        }
+    } while(!_bootstrap_used.compare_exchange_weak(used, end, std::memory_order_relaxed));
+
+    *reinterpret_cast<size_t*>(_bootstrap_heap + start - _BOOTSTRAP_HEADER) = size;
+    return _bootstrap_heap + start;
+}
+
+static size_t _bootstrapSize(void* p)
+{
+    return *reinterpret_cast<size_t*>(static_cast<char*>(p) - _BOOTSTRAP_HEADER);
+}
+// $$$$$$$$$$ Bootstrap Buffer $$$$$$$$$$ //
+
+// ********** Heap Profile ********** //
+static const char* _heap_profile_path = nullptr;
+
+static void _dumpHeapProfile()
+{
+    _dump_heap_profile(_heap_profile_path);
+}
+
+// Start sampling, and dump the profile at exit.
+static void _startHeapProfile(const char* path)
+{
+    const char* period = getenv("SMALLOC_SAMPLE_PERIOD");
+    _heap_profile_path = path;
+    atexit(_dumpHeapProfile);
+    _set_sample_period(period? strtoull(period, nullptr, 10) : _DEFAULT_SAMPLE_PERIOD);
+}
+// $$$$$$$$$$ Heap Profile $$$$$$$$$$ //
+
+// ********** Reentrancy ********** //
+// Check whether the call may go to the allocator: it is constructed, and the call is not made from inside it.
+// Every call must be paired with _shimLeave().
+static bool _shimEnter()
+{
+    if(_shim_depth++ != 0)
+    {
+        return false;
+    }
+    int state = _shim_state.load(std::memory_order_acquire);
+    if(state == _SHIM_READY)
+    {
+        return true;
+    }
+    int expected = _SHIM_UNINITIALIZED;
+    if(state == _SHIM_UNINITIALIZED && _shim_state.compare_exchange_strong(expected, _SHIM_INITIALIZING))
+    {
+        smalloc_usable_size(nullptr); // Constructs the allocator.
+        const char* trace = getenv("SMALLOC_TRACE");
+        if(trace)
+        {
+            _set_trace_file(trace);
+        }
+        const char* heap_profile = getenv("SMALLOC_HEAP_PROFILE");
+        if(heap_profile)
+        {
+            _startHeapProfile(heap_profile);
+        }
+        _shim_state.store(_SHIM_READY, std::memory_order_release);
+        return true;
+    }
+    return false;
+}
+
+static void _shimLeave()
+{
+    _shim_depth--;
+}
+// $$$$$$$$$$ Reentrancy $$$$$$$$$$ //
+
+// ********** Alignment ********** //
+// The blocks of smalloc() are only aligned to 8. That is enough for an object whose size is not a multiple of 16,
+// since its alignment divides its size, but a block of a multiple of 16 bytes must be aligned to 16.
+static bool _needsAlignment(size_t size)
+{
+    return ((size + 7) & 8) == 0; // (Bit 3 of the size rounded up to 8)
+}
+
+static bool _isMisaligned(void* p, size_t size)
+{
+    return (reinterpret_cast<uintptr_t>(p) & (_MIN_ALIGNMENT - 1)) && _needsAlignment(size);
+}
+
+// Whether a block of size bytes that needs to be aligned to 16 should be allocated by smemalign() right away: the slab
+// objects and the mmapped blocks of such sizes are already aligned to 16 (see malloc_4.h), but half of the heap blocks
+// are not.
+static bool _alignOnHeap(size_t size)
+{
+    return _needsAlignment(size) && size > _TCACHE_MAX_SIZE && size <= _MAX_ALLOC;
+}
+
+// These assume that _shimEnter() succeeded.
+static void* _shimMalloc(size_t size)
+{
+    if(_alignOnHeap(size))
+    {
+        return smemalign(_MIN_ALIGNMENT, size);
+    }
+    void* p = smalloc(size);
+    if(p && _isMisaligned(p, size))
+    {
+        // (Rarely, a small block is on the heap: a thread without a cache, or a sampled block. So is a larger block if
+        // the mmap threshold rose)
+        sfree(p);
+        p = smemalign(_MIN_ALIGNMENT, size);
+    }
+    return p;
+}
+
+// An alignment of up to 8 asks for the alignment of malloc().
+static void* _shimMemalign(size_t alignment, size_t size)
+{
+    if(alignment <= 8)
+    {
+        return _shimMalloc(size);
+    }
+    return smemalign(alignment, size);
+}
+// $$$$$$$$$$ Alignment $$$$$$$$$$ //
+
+// Allocate size bytes aligned to alignment (a power of 2, or 0 for the alignment of malloc()), from the allocator or the
+// bootstrap buffer.
+// Like the libc allocator, a request of 0 bytes returns a unique pointer.
+static void* _allocate(size_t alignment, size_t size)
+{
+    if(size == 0)
+    {
+        size = 1;
+    }
+    void* p;
+    if(_shimEnter())
+    {
+        p = _shimMemalign(alignment, size);
+    }
+    else
+    {
+        p = _bootstrapAlloc(alignment, size);
+    }
+    _shimLeave();
+    if(p == nullptr)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+// Allocate size bytes aligned to alignment, rounded up to a power of 2 like the libc allocator does.
+// Return NULL and set errno to EINVAL if no power of 2 is that large.
+static void* _allocateAligned(size_t alignment, size_t size)
+{
+    if(alignment > (SIZE_MAX >> 1) + 1)
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+    size_t power = 1;
+    while(power < alignment)
+    {
+        power <<= 1;
+    }
+    return _allocate(power, size);
+}
+
+// ********** The Interposed Functions ********** //
+extern "C"
+{
+
+void* malloc(size_t size) noexcept
+{
+    return _allocate(0, size);
+}
+
+void free(void* p) noexcept
+{
+    if(p == nullptr || _isBootstrap(p))
+    {
+        return;
+    }
+    if(_shimEnter())
+    {
+        sfree(p);
+    }
+    // (A block freed from inside the allocator is leaked rather than risking its locks)
+    _shimLeave();
+}
+
+void* calloc(size_t num, size_t size) noexcept
+{
+    size_t total;
+    if(__builtin_mul_overflow(num, size, &total))
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    if(total == 0)
+    {
+        total = 1;
+    }
+    void* p;
+    if(_shimEnter())
+    {
+        if(_alignOnHeap(total))
+        {
+            p = smemalign(_MIN_ALIGNMENT, total);
+            if(p)
+            {
+                memset(p, 0, total);
+            }
+        }
+        else
+        {
+            p = scalloc(1, total);
+            if(p && _isMisaligned(p, total))
+            {
+                sfree(p);
+                p = smemalign(_MIN_ALIGNMENT, total);
+                if(p)
+                {
+                    memset(p, 0, total);
+                }
+            }
+        }
+    }
+    else
+    {
+        p = _bootstrapAlloc(_MIN_ALIGNMENT, total);
+    }
+    _shimLeave();
+    if(p == nullptr)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* realloc(void* oldp, size_t size) noexcept
+{
+    if(oldp == nullptr)
+    {
+        return malloc(size);
+    }
+    if(size == 0)
+    {
+        free(oldp);
+        return nullptr;
+    }
+    if(_isBootstrap(oldp))
+    {
+        void* p = malloc(size);
+        if(p)
+        {
+            size_t old_size = _bootstrapSize(oldp);
+            memcpy(p, oldp, old_size < size? old_size : size);
+        }
+        return p;
+    }
+
+    void* p = nullptr;
+    if(_shimEnter())
+    {
+        p = srealloc(oldp, size);
+        if(p && _isMisaligned(p, size))
+        {
+            void* aligned = smemalign(_MIN_ALIGNMENT, size);
+            if(aligned)
+            {
+                memcpy(aligned, p, size);
+                sfree(p);
+                p = aligned;
+            }
+        }
+    }
+    else
+    {
+        // The allocator is being constructed by another thread, or this call is made from inside it: the block is moved
+        // to the bootstrap buffer, and the old one is leaked, as free() does. (Reading its size takes no lock)
+        p = _bootstrapAlloc(_MIN_ALIGNMENT, size);
+        if(p)
+        {
+            size_t old_size = smalloc_usable_size(oldp);
+            memcpy(p, oldp, old_size < size? old_size : size);
+        }
+    }
+    _shimLeave();
+    if(p == nullptr)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* reallocarray(void* oldp, size_t num, size_t size) noexcept
+{
+    size_t total;
+    if(__builtin_mul_overflow(num, size, &total))
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(oldp, total);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept
+{
+    return _allocateAligned(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    if(alignment == 0 || (alignment & (alignment - 1)))
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return _allocateAligned(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) noexcept
+{
+    if(alignment < sizeof(void*) || (alignment & (alignment - 1)))
+    {
+        return EINVAL;
+    }
+    int saved_errno = errno;
+    void* p = _allocateAligned(alignment, size);
+    errno = saved_errno;
+    if(p == nullptr)
+    {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+void* valloc(size_t size) noexcept
+{
+    return _allocateAligned(_SHIM_PAGE_SIZE, size);
+}
+
+void* pvalloc(size_t size) noexcept
+{
+    if(size > SIZE_MAX - (_SHIM_PAGE_SIZE - 1))
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return _allocateAligned(_SHIM_PAGE_SIZE, (size + _SHIM_PAGE_SIZE - 1) & ~static_cast<size_t>(_SHIM_PAGE_SIZE - 1));
+}
+
+size_t malloc_usable_size(void* p) noexcept
+{
+    if(p == nullptr)
+    {
+        return 0;
+    }
+    if(_isBootstrap(p))
+    {
+        return _bootstrapSize(p);
+    }
+    return smalloc_usable_size(p);
+}
+
+}
+// $$$$$$$$$$ The Interposed Functions $$$$$$$$$$ //
\ No newline at end of file
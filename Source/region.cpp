@@ -0,0 +1,164 @@
+#include <stdint.h>
+#include "smalloc.h"
+#include "region.h"
+
+#define MAX_ALLOC_SIZE 100000000
+#define _REGION_DEFAULT_CHUNK_SIZE 65536 // Below the mmap threshold of malloc_3..4, so chunks come from the heap.
+#define _REGION_MIN_ALIGNMENT 8
+
+// A chunk of a region, followed by the memory it hands out.
+struct _RegionChunk
+{
+    _RegionChunk* prev; // The chunk that was filled before this one (or the next spare chunk).
+    _RegionChunk* next; // The chunk that is filled after this one, if any.
+    char* end;
+};
+
+struct _Region
+{
+    _RegionChunk* first; // The chunk that was filled first (NULL when the region is empty).
+    _RegionChunk* current; // The chunk being filled (NULL when the region is empty).
+    char* top; // Like the program break of malloc_1: the memory of current below top is allocated.
+    _RegionChunk* spare; // Chunks that were freed by a reset, to be filled again.
+    size_t chunk_size;
+};
+
+static char* _chunkStart(_RegionChunk* chunk)
+{
+    return reinterpret_cast<char*>(chunk + 1);
+}
+
+static char* _alignUp(char* p, size_t alignment)
+{
+    return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1));
+}
+
+// Get a chunk for size bytes at the given alignment, and make it current.
+static bool _regionGrow(_Region* region, size_t size, size_t alignment)
+{
+    size_t needed = sizeof(_RegionChunk) + size + alignment - 1;
+    _RegionChunk* chunk = region->spare;
+    if(chunk != NULL && needed <= static_cast<size_t>(chunk->end - reinterpret_cast<char*>(chunk)))
+    {
+        region->spare = chunk->prev;
+    }
+    else
+    {
+        // A request that does not fit in a chunk gets a chunk of its own.
+        size_t chunk_size = needed > region->chunk_size? needed : region->chunk_size;
+        chunk = static_cast<_RegionChunk*>(smalloc(chunk_size));
+        if(chunk == NULL)
+        {
+            return false;
+        }
+        chunk->end = reinterpret_cast<char*>(chunk) + chunk_size;
+    }
+    chunk->prev = region->current;
+    chunk->next = NULL;
+    if(region->current != NULL)
+    {
+        region->current->next = chunk;
+    }
+    else
+    {
+        region->first = chunk;
+    }
+    region->current = chunk;
+    region->top = _chunkStart(chunk);
+    return true;
+}
+
+static void _freeChunks(_RegionChunk* chunk)
+{
+    while(chunk != NULL)
+    {
+        _RegionChunk* prev = chunk->prev;
+        sfree(chunk);
+        chunk = prev;
+    }
+}
+
+_Region* region_create(size_t chunk_size)
+{
+    if(chunk_size == 0)
+    {
+        chunk_size = _REGION_DEFAULT_CHUNK_SIZE;
+    }
+    if(chunk_size <= sizeof(_RegionChunk) || chunk_size > MAX_ALLOC_SIZE)
+    {
+        return NULL;
+    }
+    _Region* region = static_cast<_Region*>(smalloc(sizeof(_Region)));
+    if(region == NULL)
+    {
+        return NULL;
+    }
+    region->first = NULL;
+    region->current = NULL;
+    region->top = NULL;
+    region->spare = NULL;
+    region->chunk_size = chunk_size;
+    return region;
+}
+
+void* region_alloc(_Region* region, size_t size, size_t alignment)
+{
+    if(size == 0 || size > MAX_ALLOC_SIZE || (alignment & (alignment - 1)) != 0 || alignment > MAX_ALLOC_SIZE)
+    {
+        return NULL;
+    }
+    if(alignment < _REGION_MIN_ALIGNMENT)
+    {
+        alignment = _REGION_MIN_ALIGNMENT;
+    }
+    if(region->current != NULL)
+    {
+        char* p = _alignUp(region->top, alignment);
+        if(p <= region->current->end && size <= static_cast<size_t>(region->current->end - p))
+        {
+            region->top = p + size;
+            return p;
+        }
+    }
+    if(!_regionGrow(region, size, alignment))
+    {
+        return NULL;
+    }
+    char* p = _alignUp(region->top, alignment);
+    region->top = p + size;
+    return p;
+}
+
+_RegionMark region_mark(_Region* region)
+{
+    _RegionMark mark = { region->current, region->top };
+    return mark;
+}
+
+void region_reset_to_mark(_Region* region, _RegionMark mark)
+{
+    if(region->current != mark.chunk)
+    {
+        // The chunks filled since the mark run from the one after it to current: splice them onto the spare list whole.
+        _RegionChunk* after = mark.chunk != NULL? mark.chunk->next : region->first;
+        after->prev = region->spare;
+        region->spare = region->current;
+        if(mark.chunk != NULL)
+        {
+            mark.chunk->next = NULL;
+        }
+        else
+        {
+            region->first = NULL;
+        }
+        region->current = mark.chunk;
+    }
+    region->top = mark.top;
+}
+
+void region_destroy(_Region* region)
+{
+    _freeChunks(region->current);
+    _freeChunks(region->spare);
+    sfree(region);
+}
\ No newline at end of file
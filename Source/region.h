@@ -0,0 +1,40 @@
+#ifndef _REGION_H
+#define _REGION_H
+#include <unistd.h>
+
+// Regions: bump allocators for memory that is freed all at once, e.g. the temporaries of a request.
+// A region hands out its memory like malloc_1 does with the break, but from chunks that it gets from smalloc(), so
+// it can be rolled back to a mark (keeping its chunks for reuse) or destroyed (giving them back with sfree()).
+// The chunks a region got are only given back when it is destroyed, including the chunks of the requests that were too
+// large for a chunk.
+// A region is not thread safe.
+
+struct _Region;
+
+// A position in a region, to reset it to later.
+struct _RegionMark
+{
+    struct _RegionChunk* chunk;
+    char* top;
+};
+
+// Create a region whose chunks are chunk_size bytes (with their header), or a default size if it is 0.
+// Return NULL if the region can not be allocated.
+_Region* region_create(size_t chunk_size);
+
+// Allocate size bytes at an address that is a multiple of alignment (a power of 2, or 0 for 8).
+// Return NULL if the size is 0 or more than 100000000, if the alignment is not a power of 2, or if no chunk
+// could be allocated.
+void* region_alloc(_Region* region, size_t size, size_t alignment);
+
+// Return the current position of the region. A mark taken right after region_create() resets the region to empty.
+_RegionMark region_mark(_Region* region);
+
+// Free everything that was allocated since mark was taken, in constant time: the chunks filled since are kept for the
+// next allocations. The marks taken after mark become invalid.
+void region_reset_to_mark(_Region* region, _RegionMark mark);
+
+// Free the region and all its memory.
+void region_destroy(_Region* region);
+
+#endif
\ No newline at end of file
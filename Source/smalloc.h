@@ -7,5 +7,12 @@ void* smalloc(size_t size);
 void* scalloc(size_t num, size_t size);
 void* sfree(void* p);
 void* srealloc(void* oldp, size_t size);
+void sfree_sized(void* p, size_t size);
+size_t smalloc_usable_size(void* p);
+size_t smalloc_batch(size_t size, size_t n, void** out);
+void sfree_batch(void** ptrs, size_t n);
+void* smemalign(size_t alignment, size_t size);
+void* saligned_alloc(size_t alignment, size_t size);
+int sposix_memalign(void** memptr, size_t alignment, size_t size);
 
 #endif
\ No newline at end of file
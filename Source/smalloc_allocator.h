@@ -0,0 +1,405 @@
+#ifndef _SMALLOC_ALLOCATOR_H
+#define _SMALLOC_ALLOCATOR_H
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <memory_resource>
+#include "smalloc.h"
+#include "malloc_4.h"
+#include "region.h"
+
+// C++ adapters over smalloc (C++17, linked with malloc_4):
+//  - smalloc_allocator<T>: an allocator for the standard containers.
+//  - smalloc_resource: a std::pmr::memory_resource, smalloc_default_resource() is its shared instance.
+//  - smalloc_monotonic_resource: a resource that only frees everything at once, on a region (link region.cpp too).
+//  - smalloc_pool_resource: a resource that pools the small blocks by the size classes of the thread caches.
+// Like the standard allocators, they throw std::bad_alloc when there is no memory.
+
+#define _SMALLOC_MIN_ALIGNMENT 8 // Every block of smalloc() is aligned to 8.
+#define _SMALLOC_SLAB_ALIGNMENT 16 // The slab objects of a multiple of 16 bytes are aligned to 16 (see malloc_4.h).
+#define _POOL_BATCH_BYTES 4096 // A pool gets about this many bytes of blocks at a time from smalloc_batch().
+#define _POOL_MIN_BATCH 8
+#define _POOL_MAX_BATCH 64
+
+// The size to ask smalloc() for, for size bytes aligned to alignment: a small block that must be aligned to 16 (the
+// default alignment of operator new and of memory_resource::allocate()) is rounded up to a multiple of 16, so that it
+// is a slab object that is aligned to 16 without a call to smemalign().
+inline size_t _smallocSize(size_t size, size_t alignment)
+{
+    if(size == 0)
+    {
+        size = 1; // (An allocation of 0 bytes must still return a unique pointer)
+    }
+    if(alignment == _SMALLOC_SLAB_ALIGNMENT && size <= _TCACHE_MAX_SIZE)
+    {
+        size = (size + _SMALLOC_SLAB_ALIGNMENT - 1) & ~static_cast<size_t>(_SMALLOC_SLAB_ALIGNMENT - 1);
+    }
+    return size;
+}
+
+inline bool _isAligned(void* p, size_t alignment)
+{
+    return (reinterpret_cast<uintptr_t>(p) & (alignment - 1)) == 0;
+}
+
+// Allocate size bytes aligned to alignment, or throw std::bad_alloc.
+inline void* _smallocOrThrow(size_t size, size_t alignment)
+{
+    size = _smallocSize(size, alignment);
+    void* p;
+    if(alignment <= _SMALLOC_MIN_ALIGNMENT)
+    {
+        p = smalloc(size);
+    }
+    else if(alignment == _SMALLOC_SLAB_ALIGNMENT && size <= _TCACHE_MAX_SIZE)
+    {
+        p = smalloc(size);
+        if(p != NULL && !_isAligned(p, alignment))
+        {
+            // (A thread without a cache gets its small blocks from the heap, which aligns them to 8 only)
+            sfree(p);
+            p = smemalign(alignment, size);
+        }
+    }
+    else
+    {
+        p = smemalign(alignment, size);
+    }
+    if(p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+// Free a block of _smallocOrThrow(size, alignment).
+inline void _sfreeSized(void* p, size_t size, size_t alignment)
+{
+    sfree_sized(p, _smallocSize(size, alignment));
+}
+
+// ********** smalloc_allocator ********** //
+template<class T>
+class smalloc_allocator
+{
+public:
+    typedef T value_type;
+
+    smalloc_allocator() noexcept = default;
+
+    template<class U>
+    smalloc_allocator(const smalloc_allocator<U>&) noexcept
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        if(n > SIZE_MAX / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T*>(_smallocOrThrow(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+        _sfreeSized(p, n * sizeof(T), alignof(T));
+    }
+};
+
+// All the smalloc_allocators are interchangeable.
+template<class T, class U>
+bool operator==(const smalloc_allocator<T>&, const smalloc_allocator<U>&) noexcept
+{
+    return true;
+}
+
+template<class T, class U>
+bool operator!=(const smalloc_allocator<T>&, const smalloc_allocator<U>&) noexcept
+{
+    return false;
+}
+// $$$$$$$$$$ smalloc_allocator $$$$$$$$$$ //
+
+// ********** smalloc_resource ********** //
+class smalloc_resource : public std::pmr::memory_resource
+{
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        return _smallocOrThrow(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override
+    {
+        _sfreeSized(p, bytes, alignment);
+    }
+
+    // All the smalloc_resources are interchangeable.
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return dynamic_cast<const smalloc_resource*>(&other) != nullptr;
+    }
+};
+
+inline smalloc_resource* smalloc_default_resource() noexcept
+{
+    static smalloc_resource resource;
+    return &resource;
+}
+// $$$$$$$$$$ smalloc_resource $$$$$$$$$$ //
+
+// ********** smalloc_monotonic_resource ********** //
+// A resource that bumps a pointer through the chunks of a region, and frees nothing until release() or its
+// destruction. It is not thread safe.
+class smalloc_monotonic_resource : public std::pmr::memory_resource
+{
+    _Region* region;
+    _RegionMark empty;
+
+public:
+    // The region gets chunks of chunk_size bytes from smalloc(), or of the default size of regions if it is 0.
+    explicit smalloc_monotonic_resource(size_t chunk_size = 0)
+    {
+        region = region_create(chunk_size);
+        if(region == NULL)
+        {
+            throw std::bad_alloc();
+        }
+        empty = region_mark(region);
+    }
+
+    smalloc_monotonic_resource(smalloc_monotonic_resource const&) = delete; // disable copy ctor
+    void operator=(smalloc_monotonic_resource const&) = delete; // disable = operator
+
+    ~smalloc_monotonic_resource() override
+    {
+        region_destroy(region);
+    }
+
+    // Free everything that was allocated (the chunks are kept for the next allocations).
+    void release()
+    {
+        region_reset_to_mark(region, empty);
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        void* p = region_alloc(region, bytes > 0? bytes : 1, alignment);
+        if(p == NULL)
+        {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    void do_deallocate(void*, size_t, size_t) override
+    {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+// $$$$$$$$$$ smalloc_monotonic_resource $$$$$$$$$$ //
+
+// ********** smalloc_pool_resource ********** //
+// A resource that keeps a free list for each size class of the thread caches (8 bytes apart, up to _TCACHE_MAX_SIZE),
+// so that the nodes of std::map, std::list, ... are recycled without a call to the allocator, and are taken from it
+// in batches of slab objects (which have no header). A block aligned to 16 comes from a class of a multiple of 16.
+// The larger and the over-aligned blocks are allocated one by one, behind a header that links them in a list, so that
+// release() frees them too. It is not thread safe.
+class smalloc_pool_resource : public std::pmr::memory_resource
+{
+    // The blocks that were taken by one call to smalloc_batch(), to give back at release().
+    struct _PoolBatch
+    {
+        _PoolBatch* next;
+        size_t num_blocks;
+
+        void** blocks()
+        {
+            return reinterpret_cast<void**>(this + 1);
+        }
+    };
+
+    // The header of a larger or over-aligned block, right before the memory it hands out.
+    struct _PoolLarge
+    {
+        _PoolLarge* next;
+        _PoolLarge* prev;
+        size_t offset; // From the start of the block to the memory it hands out (a multiple of its alignment).
+
+        void* block()
+        {
+            return reinterpret_cast<char*>(this + 1) - offset;
+        }
+    };
+
+    void* free_lists[_TCACHE_CLASSES] = {}; // Each free block holds the address of the next one.
+    _PoolBatch* batches = nullptr;
+    _PoolLarge* large = nullptr;
+
+    static size_t classOf(size_t bytes)
+    {
+        return (bytes - 1) / 8;
+    }
+
+    static bool isPooled(size_t size, size_t alignment)
+    {
+        return size <= _TCACHE_MAX_SIZE && alignment <= _SMALLOC_SLAB_ALIGNMENT;
+    }
+
+    _PoolBatch* newBatch(size_t n)
+    {
+        _PoolBatch* batch = static_cast<_PoolBatch*>(_smallocOrThrow(sizeof(_PoolBatch) + n * sizeof(void*), 0));
+        batch->next = batches;
+        batch->num_blocks = 0;
+        batches = batch;
+        return batch;
+    }
+
+    // Fill the empty free list of class index with a new batch of blocks.
+    void refill(size_t index)
+    {
+        size_t size = (index + 1) * 8;
+        size_t n = _POOL_BATCH_BYTES / size;
+        n = n < _POOL_MIN_BATCH? _POOL_MIN_BATCH : n > _POOL_MAX_BATCH? _POOL_MAX_BATCH : n;
+        _PoolBatch* batch = newBatch(n);
+        batch->num_blocks = smalloc_batch(size, n, batch->blocks());
+        bool aligned = size % _SMALLOC_SLAB_ALIGNMENT == 0; // The blocks of this class must be aligned to 16.
+        for(size_t i = batch->num_blocks; i > 0; i--)
+        {
+            void* p = batch->blocks()[i - 1];
+            if(!aligned || _isAligned(p, _SMALLOC_SLAB_ALIGNMENT))
+            {
+                *static_cast<void**>(p) = free_lists[index];
+                free_lists[index] = p;
+            }
+        }
+        if(free_lists[index] == nullptr)
+        {
+            // (A thread without a cache gets its small blocks from the heap, which aligns them to 8 only: the blocks
+            // that are not aligned stay in their batch until release())
+            batch = newBatch(1);
+            batch->blocks()[0] = _smallocOrThrow(size, aligned? _SMALLOC_SLAB_ALIGNMENT : 0);
+            batch->num_blocks = 1;
+            *static_cast<void**>(batch->blocks()[0]) = nullptr;
+            free_lists[index] = batch->blocks()[0];
+        }
+    }
+
+    void* allocateLarge(size_t bytes, size_t alignment)
+    {
+        // The header takes the smallest multiple of the alignment (and of 16) that it fits in:
+        size_t offset = alignment > sizeof(_PoolLarge)? alignment : 32;
+        if(bytes > SIZE_MAX - offset)
+        {
+            throw std::bad_alloc();
+        }
+        char* block = static_cast<char*>(_smallocOrThrow(offset + bytes, alignment));
+        _PoolLarge* header = reinterpret_cast<_PoolLarge*>(block + offset) - 1;
+        header->next = large;
+        header->prev = nullptr;
+        header->offset = offset;
+        if(large != nullptr)
+        {
+            large->prev = header;
+        }
+        large = header;
+        return block + offset;
+    }
+
+    void deallocateLarge(void* p, size_t bytes, size_t alignment)
+    {
+        _PoolLarge* header = static_cast<_PoolLarge*>(p) - 1;
+        if(header->prev != nullptr)
+        {
+            header->prev->next = header->next;
+        }
+        else
+        {
+            large = header->next;
+        }
+        if(header->next != nullptr)
+        {
+            header->next->prev = header->prev;
+        }
+        _sfreeSized(header->block(), header->offset + bytes, alignment);
+    }
+
+public:
+    smalloc_pool_resource() = default;
+
+    smalloc_pool_resource(smalloc_pool_resource const&) = delete; // disable copy ctor
+    void operator=(smalloc_pool_resource const&) = delete; // disable = operator
+
+    ~smalloc_pool_resource() override
+    {
+        release();
+    }
+
+    // Give all the blocks back to the allocator, including the ones that are still allocated.
+    void release()
+    {
+        while(batches)
+        {
+            _PoolBatch* batch = batches;
+            batches = batch->next;
+            sfree_batch(batch->blocks(), batch->num_blocks);
+            sfree(batch);
+        }
+        for(size_t i = 0; i < _TCACHE_CLASSES; i++)
+        {
+            free_lists[i] = nullptr;
+        }
+        while(large)
+        {
+            _PoolLarge* header = large;
+            large = header->next;
+            sfree(header->block());
+        }
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        size_t size = _smallocSize(bytes, alignment);
+        if(!isPooled(size, alignment))
+        {
+            return allocateLarge(bytes, alignment);
+        }
+        size_t index = classOf(size);
+        if(free_lists[index] == nullptr)
+        {
+            refill(index);
+        }
+        void* p = free_lists[index];
+        free_lists[index] = *static_cast<void**>(p);
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override
+    {
+        size_t size = _smallocSize(bytes, alignment);
+        if(!isPooled(size, alignment))
+        {
+            deallocateLarge(p, bytes, alignment);
+            return;
+        }
+        size_t index = classOf(size);
+        *static_cast<void**>(p) = free_lists[index];
+        free_lists[index] = p;
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+// $$$$$$$$$$ smalloc_pool_resource $$$$$$$$$$ //
+
+#endif
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef _SMALLOC_HEAP_H
+#define _SMALLOC_HEAP_H
+#include <unistd.h>
+
+// The fragmentation of the heaps of the arenas of malloc_4. The slab runs and the mmapped blocks are not included.
+
+#define _HEAP_BUCKETS 768 // The lists of the histogram of the free blocks of an arena.
+
+struct _HeapFragmentation
+{
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free_block; // The payload size of the largest free block of any arena.
+    double external_fragmentation; // 1 - largest_free_block / free_bytes: the share of the free bytes that no single allocation can get.
+    size_t round_up_waste; // The bytes the blocks in use were rounded up by: to a multiple of 8, and to the smallest payload.
+    size_t leftover_waste; // The bytes at the end of the blocks in use that were too few to split off as a free block.
+};
+
+struct _HeapWalk
+{
+    _HeapFragmentation summary;
+    size_t used_blocks;
+    size_t used_bytes;
+    size_t bucket_min_size[_HEAP_BUCKETS]; // The smallest size of the free blocks of each list (its upper bound is the next one's).
+    size_t bucket_blocks[_HEAP_BUCKETS]; // The free blocks of each list, in all the arenas.
+    size_t bucket_bytes[_HEAP_BUCKETS];
+};
+
+// Fill fragmentation from the counters of the arenas and the bitmaps of their histograms. It takes constant time per
+// arena (each is locked briefly), so it can be polled, e.g. by a metrics thread.
+void _heap_fragmentation(_HeapFragmentation* fragmentation);
+
+// Walk every block of the heaps to fill walk. Each arena is locked while it is walked, which takes time in the number
+// of its blocks: the calls of the threads of that arena wait for it.
+void _heap_walk(_HeapWalk* walk);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _SMALLOC_INSTRUMENT_H
+#define _SMALLOC_INSTRUMENT_H
+#include <cstdint>
+
+// The counters malloc_4 keeps when it is compiled with -DSMALLOC_INSTRUMENT: how often each path of the allocator is
+// taken, and the latency of smalloc(), sfree() and srealloc() in cycles. Without it the counting compiles to nothing,
+// and the snapshots are all zeros.
+
+// The paths:
+#define _PATH_TCACHE 0 // A small block from the thread cache (a slab run).
+#define _PATH_HIST_HIT 1 // A heap block from the hist.
+#define _PATH_SPLIT 2 // A heap block was split, by any call, and the rest of it was freed.
+#define _PATH_WILDERNESS 3 // The free wilderness was extended to a heap block.
+#define _PATH_SBRK 4 // A new heap block was added at the top of the heap.
+#define _PATH_MMAP 5 // A new mapping for a mmapped block.
+#define _PATH_MMAP_CACHED 6 // A mmapped block in a cached mapping.
+#define _PATH_REALLOC_A 7 // srealloc() of a heap block that kept it (and split it, if it shrank enough).
+#define _PATH_REALLOC_B 8 // srealloc() that merged the block with the free block before it.
+#define _PATH_REALLOC_C 9 // srealloc() that merged the block with the free block after it.
+#define _PATH_REALLOC_D 10 // srealloc() that merged the block with the free blocks on both sides.
+#define _PATH_REALLOC_WILDERNESS 11 // srealloc() that extended the wilderness it was in.
+#define _PATH_REALLOC_MREMAP 12 // srealloc() of a mmapped block with mremap().
+#define _PATH_REALLOC_COPY 13 // srealloc() that moved the block to a new one (including slab objects that outgrew their class).
+#define _PATH_COUNT 14
+
+// The timed calls:
+#define _OP_SMALLOC 0
+#define _OP_SFREE 1
+#define _OP_SREALLOC 2
+#define _OP_COUNT 3
+
+#define _LATENCY_BUCKETS 32 // Bucket i counts the calls of [2^i, 2^(i+1)) cycles (bucket 0 also 0), the last one all above.
+
+struct _InstrumentSnapshot
+{
+    uint64_t paths[_PATH_COUNT];
+    uint64_t latency[_OP_COUNT][_LATENCY_BUCKETS];
+};
+
+// Copy the counters into snapshot. Each counter is read atomically, but they are not all read at the same instant.
+// Return false (and zero snapshot) if malloc_4 was compiled without SMALLOC_INSTRUMENT.
+bool _instrument_snapshot(_InstrumentSnapshot* snapshot);
+
+// Zero all the counters.
+void _instrument_reset();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,17 @@
+#ifndef _SMALLOC_PROFILE_H
+#define _SMALLOC_PROFILE_H
+#include <unistd.h>
+
+// The heap profiler of malloc_4: it samples about one allocation (smalloc(), scalloc() or srealloc()) per period bytes,
+// and records the call stack of each sampled allocation until the block is freed.
+
+// Sample about one allocation per period bytes, or stop sampling if period is 0 (the default). The samples that were
+// taken so far are kept.
+void _set_sample_period(size_t period);
+
+// Write the live and the cumulative heap profiles to the file at path (truncated), in the heap profile format of
+// gperftools, which pprof reads: pprof -inuse_space <program> <path> shows the live heap, and -alloc_space all the
+// allocations sampled so far. Return false if the file can not be written.
+bool _dump_heap_profile(const char* path);
+
+#endif
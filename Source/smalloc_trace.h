@@ -0,0 +1,38 @@
+#ifndef _SMALLOC_TRACE_H
+#define _SMALLOC_TRACE_H
+#include <cstdint>
+#include <unistd.h>
+
+// The format of the traces malloc_4 records (see _set_trace_file()): a _TraceHeader, then one _TraceRecord per call,
+// in the order the calls took effect.
+#define _TRACE_MAGIC "SMTRACE"
+#define _TRACE_VERSION 1
+
+// The operations of the records:
+#define _TRACE_MALLOC 1 // smalloc() and smalloc_batch(), one record per block.
+#define _TRACE_CALLOC 2 // scalloc(), with size = num * size.
+#define _TRACE_REALLOC 3 // srealloc() of a block, ptr is the new address and old_ptr the old one.
+#define _TRACE_FREE 4 // sfree(), sfree_sized() and sfree_batch(), one record per block.
+#define _TRACE_MEMALIGN 5 // smemalign(), saligned_alloc() and sposix_memalign(), with the alignment in old_ptr.
+
+struct _TraceHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct _TraceRecord
+{
+    uint64_t time; // Nanoseconds since the trace was started.
+    uint64_t ptr; // The address the call returned, or freed. Addresses identify the blocks while they are live.
+    uint64_t old_ptr;
+    uint32_t size;
+    uint32_t op;
+};
+
+// Start tracing the calls of all threads into the file at path (truncated), or stop if path is NULL.
+// Return false if the file can not be opened. Tracing is stopped at exit as well, which flushes the trace.
+bool _set_trace_file(const char* path);
+
+#endif
\ No newline at end of file